@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -17,42 +17,212 @@
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+//
+// Each buffer sits on the chain of the hash bucket for its
+// (dev, blockno), and a bucket's lock covers the refcnt and
+// identity of the buffers on its chain, so that finding a cached
+// block and releasing it take only that bucket's lock.
+//
+// Buffers are allocated with kmalloc() as they are needed, up to
+// a limit that binit() sets from the free memory at boot. Once the
+// cache is that big, bget() recycles the least recently used unused
+// buffer. Every buffer is on the LRU list, under bcache.lrulock; the
+// release of its last reference moves it to the front, and bvictim()
+// takes from the back. A hit in bget() touches only its bucket.
+// If every buffer is referenced or dirty, bget() sleeps until
+// brelse() frees one. Under memory pressure, bshrink() gives unused
+// buffers back, down to NBUF.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
 
-struct {
+#define BCHAIN   4    // buffers per hash bucket when the cache is full
+#define BSHRINK  32   // buffers bshrink() frees at a time
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;       // chain through prev/next
+};
 
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+struct {
+  struct spinlock lock;   // held while adding, recycling or freeing a buffer
+  struct bucket *bucket;
+  uint nbucket;           // a power of two
+  struct spinlock lrulock;
+  struct buf lru;         // every buffer; lru.lnext is the most recently used
+  int nbuf;
+  int maxbuf;
+  int waiting;            // processes in bget() waiting for a buffer
 } bcache;
 
+#define BUCKET(dev, blockno) \
+  (&bcache.bucket[((dev) * 1031 + (blockno)) & (bcache.nbucket - 1)])
+
+static void
+bunlink(struct bucket *bk, struct buf *b)
+{
+  if(b->prev)
+    b->prev->next = b->next;
+  else
+    bk->head = b->next;
+  if(b->next)
+    b->next->prev = b->prev;
+}
+
+static void
+blink(struct bucket *bk, struct buf *b)
+{
+  b->next = bk->head;
+  b->prev = 0;
+  if(bk->head)
+    bk->head->prev = b;
+  bk->head = b;
+}
+
+// Move b to the front of the LRU list, or put it there if new.
+// Caller holds bcache.lrulock.
+static void
+lrufront(struct buf *b)
+{
+  if(b->lnext){
+    b->lnext->lprev = b->lprev;
+    b->lprev->lnext = b->lnext;
+  }
+  b->lnext = bcache.lru.lnext;
+  b->lprev = &bcache.lru;
+  bcache.lru.lnext->lprev = b;
+  bcache.lru.lnext = b;
+}
+
+// Zeroed memory of at least size bytes for binit().
+static void*
+bootalloc(uint size)
+{
+  char *p;
+  int order;
+
+  for(order = 0; (PGSIZE << order) < size; order++)
+    ;
+  if(order > MAXORDER || (p = kalloc_order(order)) == 0)
+    panic("binit");
+  memset(p, 0, PGSIZE << order);
+  return p;
+}
+
+// Called once the free memory is known (after kinit2()).
 void
 binit(void)
 {
-  struct buf *b;
+  uint i, n;
 
   initlock(&bcache.lock, "bcache");
+  initlock(&bcache.lrulock, "bcache.lru");
+  bcache.lru.lprev = bcache.lru.lnext = &bcache.lru;
 
 //PAGEBREAK!
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  // Let the cache grow to 1/16 of free memory, as far as a
+  // bucket table in one buddy block allows.
+  bcache.maxbuf = kfreecount() / 16 * (PGSIZE/BSIZE);
+  for(n = 1; n*BCHAIN < bcache.maxbuf; n <<= 1)
+    ;
+  while(n*sizeof(struct bucket) > (PGSIZE << MAXORDER))
+    n >>= 1;
+  if(bcache.maxbuf > n*BCHAIN)
+    bcache.maxbuf = n*BCHAIN;
+  if(bcache.maxbuf < NBUF)
+    bcache.maxbuf = NBUF;
+
+  bcache.nbucket = n;
+  bcache.bucket = bootalloc(n*sizeof(struct bucket));
+  for(i = 0; i < n; i++)
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
+}
+
+// Allocate a new buffer, not on any chain. Caller holds bcache.lock.
+static struct buf*
+bnew(void)
+{
+  struct buf *b;
+
+  if(bcache.nbuf >= bcache.maxbuf || (b = kmalloc(sizeof(*b))) == 0)
+    return 0;
+  if((b->data = kmalloc(BSIZE)) == 0){
+    kmfree(b);
+    return 0;
+  }
+  initsleeplock(&b->lock, "buffer");
+  b->refcnt = 0;
+  b->lnext = 0;
+  acquire(&bcache.lrulock);
+  lrufront(b);
+  release(&bcache.lrulock);
+  bcache.nbuf++;
+  return b;
+}
+
+// Find the least recently used buffer that is unused and clean,
+// and take it off its chain; it stays on the LRU list. Caller holds
+// bcache.lock, so the identity of every buffer, and hence its
+// bucket, stays put, and no buffer is freed. Lock order is a bucket
+// lock before bcache.lrulock. Returns 0 if every buffer is in use.
+static struct buf*
+bvictim(void)
+{
+  struct bucket *bk;
+  struct buf *b, *prev;
+  int i;
+
+  for(;;){
+    // Buffers still referenced are in use, so as good as
+    // recently used: move them to the front as the scan goes.
+    acquire(&bcache.lrulock);
+    b = bcache.lru.lprev;
+    for(i = 0; i < bcache.nbuf && b != &bcache.lru; i++, b = prev){
+      prev = b->lprev;
+      if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0)
+        break;
+      if(b->refcnt)
+        lrufront(b);
+    }
+    release(&bcache.lrulock);
+    if(i == bcache.nbuf || b == &bcache.lru)
+      return 0;
+
+    // Make sure, under its bucket lock, that no bget() has
+    // taken it meanwhile. Blocks that log.c has modified are
+    // pinned (bpin()), so refcnt stays above 0 until they are
+    // installed.
+    bk = BUCKET(b->dev, b->blockno);
+    acquire(&bk->lock);
+    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0){
+      bunlink(bk, b);
+      release(&bk->lock);
+      return b;
+    }
+    release(&bk->lock);
+  }
+}
+
+// Look for block blockno on device dev in bucket bk, whose
+// lock the caller holds, and take a reference to it.
+static struct buf*
+bfind(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b; b = b->next){
+    if(b->dev == dev && b->blockno == blockno){
+      b->refcnt++;
+      return b;
+    }
   }
+  return 0;
 }
 
 // Look through buffer cache for block on device dev.
@@ -61,35 +231,81 @@ binit(void)
 static struct buf*
 bget(uint dev, uint blockno)
 {
+  struct bucket *bk;
   struct buf *b;
 
-  acquire(&bcache.lock);
+  bk = BUCKET(dev, blockno);
+  acquire(&bk->lock);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  if((b = bfind(bk, dev, blockno)) != 0){
+    release(&bk->lock);
+    acquiresleep(&b->lock);
+    return b;
   }
+  release(&bk->lock);
 
-  // Not cached; recycle an unused buffer.
-  // Even if refcnt==0, B_DIRTY indicates a buffer is in use
-  // because log.c has modified it but not yet committed it.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->flags = 0;
-      b->refcnt = 1;
+  // Not cached; add a buffer or recycle an unused one.
+  acquire(&bcache.lock);
+  for(;;){
+    // Another process may have cached the block meanwhile.
+    acquire(&bk->lock);
+    if((b = bfind(bk, dev, blockno)) != 0){
+      release(&bk->lock);
       release(&bcache.lock);
       acquiresleep(&b->lock);
       return b;
     }
+    release(&bk->lock);
+
+    if((b = bnew()) != 0)
+      break;
+    // Count ourselves before the scan, so that a brelse()
+    // that the scan misses still wakes us.
+    bcache.waiting++;
+    b = bvictim();
+    if(b){
+      bcache.waiting--;
+      break;
+    }
+    sleep(&bcache, &bcache.lock);
+    bcache.waiting--;
+  }
+
+  b->dev = dev;
+  b->blockno = blockno;
+  b->flags = 0;
+  b->refcnt = 1;
+  acquire(&bk->lock);
+  blink(bk, b);
+  release(&bk->lock);
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Free up to BSHRINK unused buffers, keeping at least NBUF.
+// Called when memory runs out. Returns how many were freed.
+int
+bshrink(void)
+{
+  struct buf *b;
+  int n;
+
+  acquire(&bcache.lock);
+  for(n = 0; n < BSHRINK && bcache.nbuf > NBUF; n++){
+    if((b = bvictim()) == 0)
+      break;
+    acquire(&bcache.lrulock);
+    b->lnext->lprev = b->lprev;
+    b->lprev->lnext = b->lnext;
+    release(&bcache.lrulock);
+    bcache.nbuf--;
+    kmfree(b->data);
+    kmfree(b);
   }
-  panic("bget: no buffers");
+  release(&bcache.lock);
+  return n;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -115,8 +331,56 @@ bwrite(struct buf *b)
   iderw(b);
 }
 
+// Drop a reference to b, whose sleeplock is released.
+// Move it to the front of the LRU list if that was the last
+// reference, and wake a bget() that is waiting for a buffer.
+static void
+bput(struct buf *b)
+{
+  struct bucket *bk;
+  int wake;
+
+  bk = BUCKET(b->dev, b->blockno);
+  acquire(&bk->lock);
+  b->refcnt--;
+  wake = 0;
+  if (b->refcnt == 0) {
+    // no one is waiting for it.
+    acquire(&bcache.lrulock);
+    lrufront(b);
+    release(&bcache.lrulock);
+    wake = bcache.waiting;
+  }
+  release(&bk->lock);
+
+  if(wake){
+    acquire(&bcache.lock);
+    wakeup(&bcache);
+    release(&bcache.lock);
+  }
+}
+
+// Keep b in the cache after it is released, until bunpin().
+// For log.c, whose blocks must stay until they are installed.
+void
+bpin(struct buf *b)
+{
+  struct bucket *bk;
+
+  bk = BUCKET(b->dev, b->blockno);
+  acquire(&bk->lock);
+  b->refcnt++;
+  release(&bk->lock);
+}
+
+// Undo a bpin().
+void
+bunpin(struct buf *b)
+{
+  bput(b);
+}
+
 // Release a locked buffer.
-// Move to the head of the MRU list.
 void
 brelse(struct buf *b)
 {
@@ -124,20 +388,45 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
+  bput(b);
+}
 
-  acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+// Start reading block blockno of dev into the cache without
+// waiting for it, unless it is cached (or on its way) already
+// or bget() is short of buffers. The buffer stays locked until
+// the read is done, when ideintr() passes it to bdone().
+void
+breadahead(uint dev, uint blockno)
+{
+  struct bucket *bk;
+  struct buf *b;
+
+  bk = BUCKET(dev, blockno);
+  acquire(&bk->lock);
+  for(b = bk->head; b; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      break;
+  release(&bk->lock);
+  if(b || bcache.waiting)
+    return;
+
+  b = bget(dev, blockno);
+  if(b->flags & B_VALID){
+    brelse(b);
+    return;
   }
-  
-  release(&bcache.lock);
+  b->flags |= B_ASYNC;
+  iderw(b);
+}
+
+// Finish a read started by breadahead(), or a write that the
+// flusher (log.c) started. Called from ideintr(), so not by the
+// process that locked b.
+void
+bdone(struct buf *b)
+{
+  releasesleep(&b->lock);
+  bput(b);
 }
 //PAGEBREAK!
 // Blank page.
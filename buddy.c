@@ -0,0 +1,175 @@
+// Buddy allocator for physically contiguous runs of pages.
+//
+// kinit2() hands the top BUDDYSIZE bytes of physical memory to this
+// allocator instead of to the kalloc() free list. kalloc_order(n)
+// returns 2^n contiguous pages aligned to their own size, and
+// kfree_order() gives them back, merging each freed block with its
+// buddy for as long as the buddy is free too. kalloc() also falls
+// back to order-0 blocks from here once its own list is empty, and
+// kfree() routes such pages back.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+
+#define BPAGES  (BUDDYSIZE/PGSIZE)
+
+// A free block, linked into the list for its order.
+struct bnode {
+  struct bnode *next;
+  struct bnode *prev;
+};
+
+struct {
+  struct spinlock lock;
+  char *base;                       // first page; aligned to a MAXORDER block
+  int npages;                       // pages actually managed
+  struct bnode free[MAXORDER+1];    // list heads, one per order
+  int nfree[MAXORDER+1];            // blocks on each list
+  uchar order[BPAGES];              // order+1 if page starts a free block, else 0
+} buddy;
+
+static void
+bpush(struct bnode *b, int order)
+{
+  struct bnode *h = &buddy.free[order];
+
+  b->next = h->next;
+  b->prev = h;
+  h->next->prev = b;
+  h->next = b;
+  buddy.nfree[order]++;
+  buddy.order[((char*)b - buddy.base) / PGSIZE] = order + 1;
+}
+
+static void
+bremove(struct bnode *b, int order)
+{
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+  buddy.nfree[order]--;
+  buddy.order[((char*)b - buddy.base) / PGSIZE] = 0;
+}
+
+// Take over [vstart, vend). vstart must be aligned to a
+// MAXORDER block; a partial block at the end is split up.
+void
+buddyinit(void *vstart, void *vend)
+{
+  int i, order;
+  char *p;
+
+  initlock(&buddy.lock, "buddy");
+  for(i = 0; i <= MAXORDER; i++){
+    buddy.free[i].next = &buddy.free[i];
+    buddy.free[i].prev = &buddy.free[i];
+  }
+  buddy.base = (char*)vstart;
+  buddy.npages = ((char*)vend - (char*)vstart) / PGSIZE;
+  if(buddy.npages > BPAGES)
+    buddy.npages = BPAGES;
+
+  p = buddy.base;
+  while(p < buddy.base + buddy.npages*PGSIZE){
+    order = MAXORDER;
+    while(p + (PGSIZE << order) > buddy.base + buddy.npages*PGSIZE)
+      order--;
+    bpush((struct bnode*)p, order);
+    p += PGSIZE << order;
+  }
+}
+
+// Does v belong to the buddy allocator?
+int
+isbuddy(char *v)
+{
+  return v >= buddy.base && v < buddy.base + buddy.npages*PGSIZE;
+}
+
+// Allocate 2^order physically contiguous pages, aligned
+// to their size. Returns 0 if no block is large enough.
+char*
+kalloc_order(int order)
+{
+  struct bnode *b;
+  int k;
+
+  if(order < 0 || order > MAXORDER)
+    return 0;
+
+  acquire(&buddy.lock);
+  for(k = order; k <= MAXORDER; k++)
+    if(buddy.nfree[k] > 0)
+      break;
+  if(k > MAXORDER){
+    release(&buddy.lock);
+    return 0;
+  }
+  b = buddy.free[k].next;
+  bremove(b, k);
+
+  // Split, returning upper halves, until the block is the right size.
+  while(k > order){
+    k--;
+    bpush((struct bnode*)((char*)b + (PGSIZE << k)), k);
+  }
+  release(&buddy.lock);
+  return (char*)b;
+}
+
+// Free 2^order pages that kalloc_order(order) returned,
+// coalescing with free buddies.
+void
+kfree_order(char *v, int order)
+{
+  uint i, bi;
+
+  if(!isbuddy(v) || order < 0 || order > MAXORDER ||
+     (v - buddy.base) % (PGSIZE << order))
+    panic("kfree_order");
+
+  if(KPOISON)
+    memset(v, 1, PGSIZE << order);
+
+  acquire(&buddy.lock);
+  i = (v - buddy.base) / PGSIZE;
+  if(buddy.order[i])
+    panic("kfree_order: double free");
+  while(order < MAXORDER){
+    bi = i ^ (1 << order);
+    if(bi >= buddy.npages || buddy.order[bi] != order + 1)
+      break;
+    bremove((struct bnode*)(buddy.base + bi*PGSIZE), order);
+    if(bi < i)
+      i = bi;
+    order++;
+  }
+  bpush((struct bnode*)(buddy.base + i*PGSIZE), order);
+  release(&buddy.lock);
+}
+
+//PAGEBREAK: 16
+// Print free blocks per order and how fragmented the free
+// space is: the share of free pages that are not in the largest
+// free block. 0% means all free memory is one block.
+// Runs when user types ^P on console. No lock, as for procdump().
+void
+buddydump(void)
+{
+  int k, pages, largest;
+
+  pages = largest = 0;
+  cprintf("buddy: free blocks by order:");
+  for(k = 0; k <= MAXORDER; k++){
+    cprintf(" %d", buddy.nfree[k]);
+    pages += buddy.nfree[k] << k;
+    if(buddy.nfree[k] > 0)
+      largest = 1 << k;
+  }
+  cprintf("\n  %d of %d pages free, largest block %d pages, "
+          "fragmentation %d%%\n", pages, buddy.npages, largest,
+          pages ? 100 - 100*largest/pages : 0);
+}
@@ -229,6 +229,11 @@ consoleintr(int (*getc)(void))
   release(&cons.lock);
   if(doprocdump) {
     procdump();  // now call procdump() wo. cons.lock held
+    kallocdump();
+    buddydump();
+    slabdump();
+    idedump();
+    swapdump();
   }
 }
 
@@ -7,16 +7,30 @@ struct inode;
 struct pipe;
 struct proc;
 struct rtcdate;
+struct shm;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct vma;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+int             bshrink(void);
+void            breadahead(uint, uint);
+void            bdone(struct buf*);
+void            bpin(struct buf*);
+void            bunpin(struct buf*);
+
+// buddy.c
+void            buddyinit(void*, void*);
+int             isbuddy(char*);
+char*           kalloc_order(int);
+void            kfree_order(char*, int);
+void            buddydump(void);
 
 // console.c
 void            consoleinit(void);
@@ -43,6 +57,7 @@ struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
 void            iinit(int dev);
+int             ishrink(void);
 void            ilock(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
@@ -52,6 +67,7 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, char*, uint, uint);
+void            readahead(struct inode*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, char*, uint, uint);
 
@@ -59,6 +75,8 @@ int             writei(struct inode*, char*, uint, uint);
 void            ideinit(void);
 void            ideintr(void);
 void            iderw(struct buf*);
+void            iderwv(struct buf*, int);
+void            idedump(void);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
@@ -67,14 +85,20 @@ void            ioapicinit(void);
 
 // kalloc.c
 char*           kalloc(void);
+char*           kalloc_zeroed(void);
+uint            kfreecount(void);
+int             kzero(void);
 void            kfree(char*);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
+void            kallocdump(void);
+void            kref(char*);
 
 // kbd.c
 void            kbdintr(void);
 
 // lapic.c
+uint            cmosmemsize(void);
 void            cmostime(struct rtcdate *r);
 int             lapicid(void);
 extern volatile uint*    lapic;
@@ -86,8 +110,40 @@ void            microdelay(int);
 // log.c
 void            initlog(int dev);
 void            log_write(struct buf*);
+void            log_write_data(struct buf*);
+void            log_free(uint);
+int             log_freed(uint);
 void            begin_op();
+void            begin_opn(int);
+void            begin_opdata(int, int);
 void            end_op();
+void            log_sync(void);
+
+// mmap.c
+void            mmapinit(void);
+int             mmap(struct file*, uint, int, int, uint);
+int             munmap(uint, uint);
+void            mmapclear(struct proc*, pde_t*);
+int             mmapfork(struct proc*, struct proc*);
+int             mmapfault(struct proc*, uint, int);
+int             mmapprefault(struct proc*, uint, uint, int);
+int             mmapoverlap(struct proc*, uint, uint);
+struct vma*     vmaalloc(struct proc*, uint);
+void            mmapread(struct inode*, uint, char*, uint);
+void            mmapwrite(struct inode*, uint, char*, uint);
+
+// shm.c
+void            shminit(void);
+int             shmopen(char*, int);
+int             shmattach(int);
+int             shmdetach(uint);
+int             shmclose(int);
+void            shmfork(struct proc*, struct proc*);
+void            shmexit(struct proc*);
+void            shmdup(struct shm*);
+void            shmput(struct shm*);
+int             futexwait(uint, int);
+int             futexwake(uint);
 
 // mp.c
 extern int      ismp;
@@ -109,7 +165,10 @@ int             cpuid(void);
 void            exit(void);
 int             fork(void);
 int             growproc(int);
+int             growhuge(int);
 int             kill(int, int);
+int             setpgid(int, int);
+int             getpgid(int);
 struct cpu*     mycpu(void);
 struct proc*    myproc();
 void            pinit(void);
@@ -117,8 +176,11 @@ void            procdump(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            setproc(struct proc*);
+struct proc*    swapclaim(int);
+void            swaprelease(struct proc*);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
+void            kthread(char*, void (*)(void));
 int             wait(void);
 void            wakeup(void*);
 void            yield(void);
@@ -159,12 +221,27 @@ void            release(struct spinlock*);
 void            pushcli(void);
 void            popcli(void);
 
+// slab.c
+void            slabinit(void);
+void*           kmalloc(uint);
+void            kmfree(void*);
+void            slabdump(void);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
+// swap.c
+void            swapinit(void);
+char*           swapalloc(int);
+int             swapin(struct proc*, uint);
+int             swapinrange(struct proc*, uint, uint);
+void            swapcopy(pte_t, char*);
+void            swapdrop(pte_t);
+void            swapdump(void);
+
 // string.c
 int             memcmp(const void*, const void*, uint);
 void*           memmove(void*, const void*, uint);
@@ -177,6 +254,7 @@ char*           strncpy(char*, const char*, int);
 // syscall.c
 int             argint(int, int*);
 int             argptr(int, char**, int);
+int             argptrw(int, char**, int);
 int             argstr(int, char**);
 int             fetchint(uint, int*);
 int             fetchstr(uint, char**);
@@ -197,13 +275,18 @@ void            uartintr(void);
 void            uartputc(int);
 
 // vm.c
+extern uint     phystop;
 void            seginit(void);
 void            kvmalloc(void);
 pde_t*          setupkvm(void);
 char*           uva2ka(pde_t*, char*);
+pte_t*          walkpgdir(pde_t*, const void*, int);
+int             mappages(pde_t*, void*, uint, uint, int);
 int             allocuvm(pde_t*, uint, uint);
+int             allochugeuvm(pde_t*, uint, uint);
 int             deallocuvm(pde_t*, uint, uint);
 void            freevm(pde_t*);
+pte_t*          uvmclock(pde_t*, uint*, uint, int*);
 void            inituvm(pde_t*, char*, uint);
 int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
 pde_t*          copyuvm(pde_t*, uint);
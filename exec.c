@@ -20,7 +20,7 @@ exec(char *path, char **argv)
   pde_t *pgdir, *oldpgdir;
   struct proc *curproc = myproc();
 
-  begin_op();
+  begin_opn(IPUTBLOCKS);
 
   if((ip = namei(path)) == 0){
     end_op();
@@ -50,6 +50,8 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
+    // Have the disk fetch the segment while its memory is allocated.
+    readahead(ip, ph.off, ph.filesz);
     if((sz = allocuvm(pgdir, sz, ph.vaddr + ph.memsz)) == 0)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
@@ -101,6 +103,7 @@ exec(char *path, char **argv)
   curproc->tf->eip = elf.entry;  // main
   curproc->tf->esp = sp;
   switchuvm(curproc);
+  mmapclear(curproc, oldpgdir);
   freevm(oldpgdir);
 
   //RESET ALL CUSTOMMMM SIGNAL HANDLERS
@@ -11,9 +11,11 @@
 #include "file.h"
 
 struct devsw devsw[NDEV];
+
+// File structures come from kmalloc() as needed; the lock
+// protects every file's ref count.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
 } ftable;
 
 void
@@ -28,16 +30,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = (struct file*)kmalloc(sizeof(*f))) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -66,14 +63,13 @@ fileclose(struct file *f)
     return;
   }
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
   release(&ftable.lock);
+  kmfree(f);
 
   if(ff.type == FD_PIPE)
     pipeclose(ff.pipe, ff.writable);
   else if(ff.type == FD_INODE){
-    begin_op();
+    begin_opn(IPUTBLOCKS);
     iput(ff.ip);
     end_op();
   }
@@ -92,6 +88,33 @@ filestat(struct file *f, struct stat *st)
   return -1;
 }
 
+#define RAMIN  (4*BSIZE)    // readahead window of a new sequential reader
+#define RAMAX  (64*BSIZE)   // largest readahead window
+
+// Read ahead for a read of n bytes at f->off. Each read that
+// starts where the last one stopped doubles the window, up to
+// RAMAX; any other read (after a seek) closes it again. The
+// blocks of the read itself are always started together.
+static void
+readnext(struct file *f, int n)
+{
+  uint end;
+
+  if(f->off != f->ranext){
+    f->rawin = 0;
+    f->raend = f->off;
+  } else if(f->rawin < RAMAX)
+    f->rawin = f->rawin ? 2*f->rawin : RAMIN;
+  if(f->raend < f->off)
+    f->raend = f->off;
+
+  end = f->off + n + f->rawin;
+  if(end > f->raend){
+    readahead(f->ip, f->raend, end - f->raend);
+    f->raend = end;
+  }
+}
+
 // Read from file f.
 int
 fileread(struct file *f, char *addr, int n)
@@ -104,8 +127,10 @@ fileread(struct file *f, char *addr, int n)
     return piperead(f->pipe, addr, n);
   if(f->type == FD_INODE){
     ilock(f->ip);
+    readnext(f, n);
     if((r = readi(f->ip, addr, f->off, n)) > 0)
       f->off += r;
+    f->ranext = f->off;
     iunlock(f->ip);
     return r;
   }
@@ -124,20 +149,20 @@ filewrite(struct file *f, char *addr, int n)
   if(f->type == FD_PIPE)
     return pipewrite(f->pipe, addr, n);
   if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // write WRITECHUNK bytes at a time to avoid exceeding
+    // the maximum transaction size: the i-node, indirect and
+    // allocation blocks go through the log, and the data
+    // blocks to disk ahead of the commit.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * 512;
+    int max = WRITECHUNK;
     int i = 0;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
 
-      begin_op();
+      begin_opdata(WRITEBLOCKS, WRITEDATA(f->off, n1));
       ilock(f->ip);
       if ((r = writei(f->ip, addr + i, f->off, n1)) > 0)
         f->off += r;
@@ -6,6 +6,9 @@ struct file {
   struct pipe *pipe;
   struct inode *ip;
   uint off;
+  uint ranext;  // off after the last read; a read from there is sequential
+  uint raend;   // end of what has been read ahead
+  uint rawin;   // readahead window, in bytes
 };
 
 
@@ -23,6 +26,8 @@ struct inode {
   short nlink;
   uint size;
   uint addrs[NDIRECT+1];
+
+  struct inode *next; // icache hash chain; protected by icache.lock
 };
 
 // table mapping major device number to
@@ -35,3 +40,13 @@ struct devsw {
 extern struct devsw devsw[];
 
 #define CONSOLE 1
+
+// Blocks a writei() of n bytes at off to a file may write, for
+// begin_opdata(): the i-node, an indirect block and two bitmap
+// blocks go through the log (WRITEBLOCKS), and each block of file
+// data it touches goes to disk in place (WRITEDATA). filewrite()
+// writes WRITECHUNK bytes per transaction, so that two writers
+// fit in one.
+#define WRITEBLOCKS 4
+#define WRITEDATA(off, n) (((off) % BSIZE + (n) + BSIZE - 1) / BSIZE)
+#define WRITECHUNK ((LOGDATA/2 - 1) * BSIZE)
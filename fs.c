@@ -40,21 +40,24 @@ readsb(int dev, struct superblock *sb)
 
 // Zero a block.
 static void
-bzero(int dev, int bno)
+bzero(int dev, int bno, int data)
 {
   struct buf *bp;
 
   bp = bread(dev, bno);
   memset(bp->data, 0, BSIZE);
-  log_write(bp);
+  if(data)
+    log_write_data(bp);
+  else
+    log_write(bp);
   brelse(bp);
 }
 
 // Blocks.
 
-// Allocate a zeroed disk block.
+// Allocate a zeroed disk block, for file data if data is set.
 static uint
-balloc(uint dev)
+balloc(uint dev, int data)
 {
   int b, bi, m;
   struct buf *bp;
@@ -64,11 +67,12 @@ balloc(uint dev)
     bp = bread(dev, BBLOCK(b, sb));
     for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
       m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
+      // Is block free, and not just freed by the open transaction?
+      if((bp->data[bi/8] & m) == 0 && !log_freed(b + bi)){
         bp->data[bi/8] |= m;  // Mark block in use.
         log_write(bp);
         brelse(bp);
-        bzero(dev, b + bi);
+        bzero(dev, b + bi, data);
         return b + bi;
       }
     }
@@ -93,6 +97,7 @@ bfree(int dev, uint b)
   bp->data[bi/8] &= ~m;
   log_write(bp);
   brelse(bp);
+  log_free(b);
 }
 
 // Inodes.
@@ -120,18 +125,16 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in cache: an entry in the inode cache
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a cache entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in cache: ip->ref tracks the number of
+//   in-memory pointers to a cache entry (open files and
+//   current directories). iget() finds or kmalloc()s a
+//   cache entry and increments its ref; iput() decrements
+//   ref and frees the entry when it reaches zero.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   cache entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
-//   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   the disk and sets ip->valid.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -155,29 +158,35 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The icache.lock spin-lock protects the allocation of icache
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold icache.lock while using any of those fields.
+// Entries are kmalloc()ed by iget() and found through a hash on
+// (dev, inum). An entry whose ref drops to 0 stays cached, so that
+// the next iget() of that inode need not read the disk; ishrink()
+// frees such entries when memory runs out.
+//
+// The icache.lock spin-lock protects the hash chains. Since
+// ip->ref decides when an entry may be freed, and ip->dev and
+// ip->inum indicate which i-node an entry holds, one must hold
+// icache.lock while using any of those fields.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH   64   // icache hash buckets, a power of two
+#define ISHRINK  32   // entries ishrink() frees at a time
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *hash[NIHASH];  // chains linked by ip->next
 } icache;
 
+#define IHASH(dev, inum) \
+  (&icache.hash[((dev) * 131 + (inum)) & (NIHASH - 1)])
+
 void
 iinit(int dev)
 {
-  int i = 0;
-  
   initlock(&icache.lock, "icache");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
-  }
 
   readsb(dev, &sb);
   cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
@@ -242,27 +251,27 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, **hp;
 
   acquire(&icache.lock);
 
   // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
+  hp = IHASH(dev, inum);
+  for(ip = *hp; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
       ip->ref++;
       release(&icache.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
+  // Allocate a new inode cache entry.
+  if((ip = (struct inode*)kmalloc(sizeof(*ip))) == 0)
     panic("iget: no inodes");
 
-  ip = empty;
+  initsleeplock(&ip->lock, "inode");
+  ip->next = *hp;
+  *hp = ip;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
@@ -324,7 +333,7 @@ iunlock(struct inode *ip)
 
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode cache entry can
-// be recycled.
+// be recycled by ishrink().
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -352,6 +361,30 @@ iput(struct inode *ip)
   release(&icache.lock);
 }
 
+// Free up to ISHRINK cached inodes that nobody references.
+// Called when memory runs out. Returns how many were freed.
+int
+ishrink(void)
+{
+  struct inode *ip, **pp;
+  int i, n;
+
+  n = 0;
+  acquire(&icache.lock);
+  for(i = 0; i < NIHASH && n < ISHRINK; i++){
+    for(pp = &icache.hash[i]; (ip = *pp) != 0 && n < ISHRINK; ){
+      if(ip->ref == 0){
+        *pp = ip->next;
+        kmfree(ip);
+        n++;
+      } else
+        pp = &ip->next;
+    }
+  }
+  release(&icache.lock);
+  return n;
+}
+
 // Common idiom: unlock, then put.
 void
 iunlockput(struct inode *ip)
@@ -378,7 +411,7 @@ bmap(struct inode *ip, uint bn)
 
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+      ip->addrs[bn] = addr = balloc(ip->dev, ip->type == T_FILE);
     return addr;
   }
   bn -= NDIRECT;
@@ -386,11 +419,11 @@ bmap(struct inode *ip, uint bn)
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
+      ip->addrs[NDIRECT] = addr = balloc(ip->dev, 0);
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
     if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
+      a[bn] = addr = balloc(ip->dev, ip->type == T_FILE);
       log_write(bp);
     }
     brelse(bp);
@@ -400,6 +433,28 @@ bmap(struct inode *ip, uint bn)
   panic("bmap: out of range");
 }
 
+// Like bmap(), but return 0 for a block that was never allocated.
+static uint
+bmapget(struct inode *ip, uint bn)
+{
+  uint addr;
+  struct buf *bp;
+
+  if(bn < NDIRECT)
+    return ip->addrs[bn];
+  bn -= NDIRECT;
+
+  if(bn < NINDIRECT){
+    if((addr = ip->addrs[NDIRECT]) == 0)
+      return 0;
+    bp = bread(ip->dev, addr);
+    addr = ((uint*)bp->data)[bn];
+    brelse(bp);
+    return addr;
+  }
+  return 0;
+}
+
 // Truncate inode (discard contents).
 // Only called when the inode has no links
 // to it (no directory entries referring to it)
@@ -472,10 +527,32 @@ readi(struct inode *ip, char *dst, uint off, uint n)
     m = min(n - tot, BSIZE - off%BSIZE);
     memmove(dst, bp->data + off%BSIZE, m);
     brelse(bp);
+    if(ip->type == T_FILE)
+      mmapread(ip, off, dst, m);  // a shared mapping may be newer
   }
   return n;
 }
 
+// Start reading the blocks that hold [off, off+n) of ip into
+// the buffer cache, without waiting for them.
+// Caller must hold ip->lock.
+void
+readahead(struct inode *ip, uint off, uint n)
+{
+  uint bn, addr;
+
+  if(ip->type == T_DEV || off >= ip->size)
+    return;
+  if(off + n > ip->size || off + n < off)
+    n = ip->size - off;
+
+  for(bn = off/BSIZE; bn*BSIZE < off + n; bn++){
+    if((addr = bmapget(ip, bn)) == 0)
+      break;
+    breadahead(ip->dev, addr);
+  }
+}
+
 // PAGEBREAK!
 // Write data to inode.
 // Caller must hold ip->lock.
@@ -500,7 +577,11 @@ writei(struct inode *ip, char *src, uint off, uint n)
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
     memmove(bp->data + off%BSIZE, src, m);
-    log_write(bp);
+    if(ip->type == T_FILE){
+      log_write_data(bp);  // file data is not logged
+      mmapwrite(ip, off, src, m);
+    } else
+      log_write(bp);
     brelse(bp);
   }
 
@@ -0,0 +1,73 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "x86.h"
+
+#define PGSIZE 4096
+#define SIZE   (8*1024*1024)
+#define STRIDE (PGSIZE + 64)   // a new page and cache set each step
+#define PASSES 16
+
+/*
+* Large page benchmark.
+*
+* Walks an 8 MB region with a stride just over a page, so that
+* nearly every access needs a different TLB entry: with 4 KB pages
+* that is 2048 entries, far more than the TLB holds, while 4 MB
+* pages need just two. The region comes once from sbrk() and once
+* from sbrkhuge(), and the median cycles per access of each are
+* compared.
+*/
+
+uint sink;
+
+uint
+walk(char *p){
+    uint start, sum;
+    int off;
+
+    sum = 0;
+    start = rdtsc();
+    for(off = 0; off + sizeof(int) <= SIZE; off += STRIDE)
+        sum += *(volatile int*)(p + off);
+    start = rdtsc() - start;
+    sink += sum;
+    return start;
+}
+
+uint
+bench(char *p){
+    uint v[PASSES], t;
+    int i, j;
+
+    memset(p, 1, SIZE);
+    walk(p);
+    for(i = 0; i < PASSES; i++){
+        t = walk(p);
+        for(j = i; j > 0 && v[j-1] > t; j--)
+            v[j] = v[j-1];
+        v[j] = t;
+    }
+    return v[PASSES/2] / (SIZE / STRIDE);
+}
+
+int
+main(void){
+    char *p;
+    uint small, huge;
+
+    if((p = sbrk(SIZE)) == (char*)-1){
+        printf(2, "hugebench: sbrk failed\n");
+        exit();
+    }
+    small = bench(p);
+
+    if((p = sbrkhuge(SIZE)) == (char*)-1){
+        printf(2, "hugebench: sbrkhuge failed\n");
+        exit();
+    }
+    huge = bench(p);
+
+    printf(1, "cycles per access: 4KB pages %d, 4MB pages %d\n", small, huge);
+    exit();
+}
@@ -1,4 +1,6 @@
-// Simple PIO-based (non-DMA) IDE driver code.
+// Simple IDE driver code. Blocks move by PCI bus-master DMA
+// if ideinit() finds a controller that does it (such as the
+// PIIX that QEMU emulates), else by programmed I/O.
 
 #include "types.h"
 #include "defs.h"
@@ -23,16 +25,67 @@
 #define IDE_CMD_WRITE 0x30
 #define IDE_CMD_RDMUL 0xc4
 #define IDE_CMD_WRMUL 0xc5
+#define IDE_CMD_RDDMA 0xc8
+#define IDE_CMD_WRDMA 0xca
+#define IDE_CMD_SETMUL 0xc6
 
-// idequeue points to the buf now being read/written to the disk.
-// idequeue->qnext points to the next buf to be processed.
+// PCI configuration space.
+#define PCI_ADDR      0xcf8
+#define PCI_DATA      0xcfc
+#define PCI_CMD       0x04    // command register
+#define PCI_CLASS     0x08    // class, subclass, prog-if, revision
+#define PCI_BAR4      0x20    // IDE: bus-master registers
+#define PCI_CMD_IO    0x01    // respond to I/O space accesses
+#define PCI_CMD_BM    0x04    // may act as bus master
+
+// Bus-master registers of the primary channel, at idebm.
+#define BM_CMD        0
+#define BM_STATUS     2
+#define BM_PRDT       4
+#define BM_START      0x01    // in BM_CMD
+#define BM_TOMEM      0x08    // in BM_CMD: device to memory
+#define BM_ERR        0x02    // in BM_STATUS, write 1 to clear
+#define BM_INTR       0x04    // in BM_STATUS, write 1 to clear
+
+// Physical region descriptor: one piece of a DMA transfer,
+// which must not cross a 64 KB boundary.
+struct prd {
+  uint addr;
+  ushort count;           // bytes
+  ushort flags;
+};
+#define PRD_EOT       0x8000  // last descriptor of the table
+#define NPRD          32      // enough for a whole log region (log.c)
+
+// The table must not cross a 64 KB boundary either.
+static struct prd prdt[NPRD] __attribute__((aligned(NPRD*sizeof(struct prd))));
+static ushort idebm;    // bus-master base port, or 0 to use PIO
+
+// idequeue holds the bufs waiting for the disk, sorted by
+// (dev, blockno) and chained through qnext. idestart() serves it
+// like an elevator going up: it takes the first buf at or past
+// where the last command ended, wrapping around to the lowest,
+// together with the bufs right after it that continue it on disk
+// in the same direction, and sends them as one command. idecur
+// chains the bufs of that command until ideintr() finishes them.
 // You must hold idelock while manipulating queue.
 
+#define IDEMULT       8     // sectors per PIO command (SET MULTIPLE)
+
 static struct spinlock idelock;
 static struct buf *idequeue;
+static struct buf *idecur;
+static uint idedev, ideblock;   // where the last command ended
+
+// Statistics, for idedump().
+static int idedepth;            // bufs in idequeue
+static int idemaxdepth;
+static uint idereqs;            // bufs passed to iderw()
+static uint idecmds;            // commands sent to the disk
+static uint idemerged;          // bufs that rode along in another's command
 
 static int havedisk1;
-static void idestart(struct buf*);
+static void idestart(void);
 
 // Wait for IDE disk to become ready.
 static int
@@ -47,6 +100,47 @@ idewait(int checkerr)
   return 0;
 }
 
+static uint
+pciread(int dev, int func, int reg)
+{
+  outl(PCI_ADDR, 0x80000000 | dev<<11 | func<<8 | reg);
+  return inl(PCI_DATA);
+}
+
+static void
+pciwrite(int dev, int func, int reg, uint v)
+{
+  outl(PCI_ADDR, 0x80000000 | dev<<11 | func<<8 | reg);
+  outl(PCI_DATA, v);
+}
+
+// Look on PCI bus 0 for an IDE controller that can do bus-master
+// DMA, and enable it. Sets idebm if there is one.
+static void
+idedmainit(void)
+{
+  int dev, func;
+  uint class, bar;
+
+  for(dev = 0; dev < 32; dev++){
+    for(func = 0; func < 8; func++){
+      if((pciread(dev, func, 0) & 0xffff) == 0xffff)
+        continue;
+      class = pciread(dev, func, PCI_CLASS);
+      // Mass storage, IDE, bus-master capable.
+      if((class >> 16) != 0x0101 || !(class & (0x80 << 8)))
+        continue;
+      bar = pciread(dev, func, PCI_BAR4);
+      if(!(bar & 1) || (bar & ~3) == 0)
+        continue;
+      pciwrite(dev, func, PCI_CMD,
+               pciread(dev, func, PCI_CMD) | PCI_CMD_IO | PCI_CMD_BM);
+      idebm = bar & ~3;
+      return;
+    }
+  }
+}
+
 void
 ideinit(void)
 {
@@ -65,67 +159,174 @@ ideinit(void)
     }
   }
 
+  // Let each disk move IDEMULT sectors per interrupt
+  // with READ/WRITE MULTIPLE.
+  for(i = 0; i <= havedisk1; i++){
+    outb(0x1f6, 0xe0 | (i<<4));
+    outb(0x1f2, IDEMULT);
+    outb(0x1f7, IDE_CMD_SETMUL);
+    idewait(0);
+  }
+
   // Switch back to disk 0.
   outb(0x1f6, 0xe0 | (0<<4));
+
+  idedmainit();
 }
 
-// Start the request for b.  Caller must hold idelock.
+// Is buf a before buf b on disk?
+static int
+idebefore(struct buf *a, struct buf *b)
+{
+  return a->dev < b->dev || (a->dev == b->dev && a->blockno < b->blockno);
+}
+
+// Send the next command, if any bufs are waiting.
+// Caller must hold idelock.
 static void
-idestart(struct buf *b)
+idestart(void)
 {
-  if(b == 0)
-    panic("idestart");
-  if(b->blockno >= FSSIZE)
-    panic("incorrect blockno");
+  struct buf *b, *last, **pp, **start;
   int sector_per_block =  BSIZE/SECTOR_SIZE;
-  int sector = b->blockno * sector_per_block;
-  int read_cmd = (sector_per_block == 1) ? IDE_CMD_READ :  IDE_CMD_RDMUL;
-  int write_cmd = (sector_per_block == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
+  int n, max, sector, nsect;
+
+  if(idecur || idequeue == 0)
+    return;
+
+  // Elevator: first buf at or past the end of the last command.
+  start = &idequeue;
+  for(pp = &idequeue; *pp; pp = &(*pp)->qnext){
+    if((*pp)->dev > idedev || ((*pp)->dev == idedev && (*pp)->blockno >= ideblock)){
+      start = pp;
+      break;
+    }
+  }
+
+  // Merge the bufs that continue it.
+  max = idebm ? NPRD : IDEMULT / sector_per_block;
+  b = last = *start;
+  for(n = 1; n < max; n++){
+    if(last->qnext == 0 || last->qnext->dev != b->dev ||
+       last->qnext->blockno != last->blockno + 1 ||
+       (last->qnext->flags & B_DIRTY) != (b->flags & B_DIRTY))
+      break;
+    last = last->qnext;
+  }
+  *start = last->qnext;
+  last->qnext = 0;
+  idecur = b;
+  idedepth -= n;
+  idecmds++;
+  idemerged += n - 1;
+  idedev = last->dev;
+  ideblock = last->blockno + 1;
 
-  if (sector_per_block > 7) panic("idestart");
+  if(last->blockno >= (b->dev == SWAPDEV ? SWAPSTART + NSWAPPG*(PGSIZE/BSIZE) : FSSIZE))
+    panic("incorrect blockno");
+  sector = b->blockno * sector_per_block;
+  nsect = n * sector_per_block;
+  if (nsect > (idebm ? 255 : IDEMULT)) panic("idestart");
 
   idewait(0);
+  if(idebm){
+    for(n = 0, last = b; last; last = last->qnext, n++){
+      prdt[n].addr = V2P(last->data);
+      prdt[n].count = BSIZE;
+      prdt[n].flags = last->qnext ? 0 : PRD_EOT;
+    }
+    outl(idebm + BM_PRDT, V2P(prdt));
+    outb(idebm + BM_STATUS, BM_ERR|BM_INTR);
+    outb(idebm + BM_CMD, (b->flags & B_DIRTY) ? 0 : BM_TOMEM);
+  }
   outb(0x3f6, 0);  // generate interrupt
-  outb(0x1f2, sector_per_block);  // number of sectors
+  outb(0x1f2, nsect);  // number of sectors
   outb(0x1f3, sector & 0xff);
   outb(0x1f4, (sector >> 8) & 0xff);
   outb(0x1f5, (sector >> 16) & 0xff);
   outb(0x1f6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
-  if(b->flags & B_DIRTY){
-    outb(0x1f7, write_cmd);
-    outsl(0x1f0, b->data, BSIZE/4);
+  if(idebm){
+    outb(0x1f7, (b->flags & B_DIRTY) ? IDE_CMD_WRDMA : IDE_CMD_RDDMA);
+    outb(idebm + BM_CMD, inb(idebm + BM_CMD) | BM_START);
+  } else if(b->flags & B_DIRTY){
+    outb(0x1f7, nsect == 1 ? IDE_CMD_WRITE : IDE_CMD_WRMUL);
+    for(; b; b = b->qnext)
+      outsl(0x1f0, b->data, BSIZE/4);
   } else {
-    outb(0x1f7, read_cmd);
+    outb(0x1f7, nsect == 1 ? IDE_CMD_READ : IDE_CMD_RDMUL);
   }
 }
 
+// Put b into idequeue. Caller must hold idelock.
+static void
+idequeueadd(struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp=&idequeue; *pp && idebefore(*pp, b); pp=&(*pp)->qnext)  //DOC:insert-queue
+    ;
+  b->qnext = *pp;
+  *pp = b;
+  if(++idedepth > idemaxdepth)
+    idemaxdepth = idedepth;
+}
+
 // Interrupt handler.
 void
 ideintr(void)
 {
-  struct buf *b;
+  struct buf *b, *next;
+  uchar st;
 
-  // First queued buffer is the active request.
+  // idecur holds the bufs of the active command.
   acquire(&idelock);
 
-  if((b = idequeue) == 0){
+  if((b = idecur) == 0){
     release(&idelock);
     return;
   }
-  idequeue = b->qnext;
+
+  if(idebm){
+    // The data is already in place. Stop the engine and
+    // acknowledge the interrupt; if the transfer failed, give
+    // up on DMA and do it again by PIO.
+    outb(idebm + BM_CMD, 0);
+    st = inb(idebm + BM_STATUS);
+    outb(idebm + BM_STATUS, BM_ERR|BM_INTR);
+    if(idewait(1) < 0 || (st & BM_ERR)){
+      cprintf("ide: dma failed, using pio\n");
+      idebm = 0;
+      idecur = 0;
+      for(; b; b = next){
+        next = b->qnext;
+        idequeueadd(b);
+      }
+      idestart();
+      release(&idelock);
+      return;
+    }
+  }
+  idecur = 0;
 
   // Read data if needed.
-  if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, BSIZE/4);
+  if(!idebm && !(b->flags & B_DIRTY) && idewait(1) >= 0)
+    for(next = b; next; next = next->qnext)
+      insl(0x1f0, next->data, BSIZE/4);
 
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+  // Wake process waiting for each buf, or
+  // release it if it was read ahead.
+  for(; b; b = next){
+    next = b->qnext;
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    if(b->flags & B_ASYNC){
+      b->flags &= ~B_ASYNC;
+      bdone(b);
+    } else
+      wakeup(b);
+  }
 
-  // Start disk on next buf in queue.
-  if(idequeue != 0)
-    idestart(idequeue);
+  // Start disk on next bufs in queue.
+  idestart();
 
   release(&idelock);
 }
@@ -134,11 +335,11 @@ ideintr(void)
 // Sync buf with disk.
 // If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
 // Else if B_VALID is not set, read buf from disk, set B_VALID.
+// If B_ASYNC is set, only start the read or write; ideintr()
+// finishes it.
 void
 iderw(struct buf *b)
 {
-  struct buf **pp;
-
   if(!holdingsleep(&b->lock))
     panic("iderw: buf not locked");
   if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
@@ -148,15 +349,16 @@ iderw(struct buf *b)
 
   acquire(&idelock);  //DOC:acquire-lock
 
-  // Append b to idequeue.
-  b->qnext = 0;
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
-    ;
-  *pp = b;
+  idereqs++;
+  idequeueadd(b);
 
   // Start disk if necessary.
-  if(idequeue == b)
-    idestart(b);
+  idestart();
+
+  if(b->flags & B_ASYNC){
+    release(&idelock);
+    return;
+  }
 
   // Wait for request to finish.
   while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
@@ -166,3 +368,41 @@ iderw(struct buf *b)
 
   release(&idelock);
 }
+
+// Sync the n bufs b[0..n) with disk, as iderw() does, but queue
+// them all before waiting, so that idestart() can send runs of
+// adjacent ones as single commands.
+void
+iderwv(struct buf *b, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    if(!holdingsleep(&b[i].lock))
+      panic("iderwv: buf not locked");
+    if((b[i].flags & (B_VALID|B_DIRTY)) == B_VALID || (b[i].flags & B_ASYNC))
+      panic("iderwv: nothing to do");
+    if(b[i].dev != 0 && !havedisk1)
+      panic("iderwv: ide disk 1 not present");
+  }
+
+  acquire(&idelock);
+  idereqs += n;
+  for(i = 0; i < n; i++)
+    idequeueadd(&b[i]);
+  idestart();
+  for(i = 0; i < n; i++)
+    while((b[i].flags & (B_VALID|B_DIRTY)) != B_VALID)
+      sleep(&b[i], &idelock);
+  release(&idelock);
+}
+
+// Print request and queue statistics.
+// Runs when user types ^P on console. No lock, as for procdump().
+void
+idedump(void)
+{
+  cprintf("ide: %s, %d requests in %d commands (%d merged), "
+          "queue depth %d max %d\n", idebm ? "dma" : "pio",
+          idereqs, idecmds, idemerged, idedepth, idemaxdepth);
+}
@@ -7,8 +7,13 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "proc.h"
 #include "spinlock.h"
 
+#define KMAG    32         // max pages cached per cpu
+#define KBATCH  (KMAG/2)   // pages moved to/from the global list at once
+#define KZEROMAX 1024      // stop background zeroing at this many pages
+
 void freerange(void *vstart, void *vend);
 extern char end[]; // first address after kernel loaded from ELF file
                    // defined by the kernel linker script in kernel.ld
@@ -17,10 +22,46 @@ struct run {
   struct run *next;
 };
 
+// Per-cpu cache ("magazine") of free pages. kalloc() and kfree()
+// work on the current cpu's cache and only take kmem.lock to move
+// KBATCH pages at a time between it and the global free list.
+// The per-cpu lock is uncontended except when another cpu has run
+// the global list dry and steals from this cache.
+//
+// Freed pages are not cleared. Idle cpus zero pages from the global
+// free list in the background (kzero()) and park them on zerolist,
+// from which kalloc_zeroed() hands them out. A zeroed page is all
+// zero except for the run link in its first word.
+//
+// A page mapped into several page tables (shared mmap() regions)
+// carries a count of its extra references in kmem.ref[]; kref()
+// adds one and kfree() drops one, freeing the page only when
+// none are left. Pages that were never kref()ed cost kfree() one
+// unlocked read: if the count is 0 the caller is the sole owner,
+// and nobody else can raise it.
+struct kcache {
+  struct spinlock lock;
+  struct run *freelist;
+  int nfree;
+  struct run *zerolist;
+  int nzero;
+  uint hits;     // kalloc() served from this cache
+  uint misses;   // kalloc() had to refill from kmem
+  uint spills;   // kfree() overflowed back to kmem
+  uint zhits;    // kalloc_zeroed() got a pre-zeroed page
+  uint zmisses;  // kalloc_zeroed() had to memset
+};
+
 struct {
   struct spinlock lock;
   int use_lock;
   struct run *freelist;
+  int nfree;
+  struct run *zerolist;
+  int nzero;
+  struct kcache cpu[NCPU];
+  struct spinlock reflock;
+  ushort *ref;        // extra references, per physical page
 } kmem;
 
 // Initialization happens in two phases.
@@ -31,15 +72,36 @@ struct {
 void
 kinit1(void *vstart, void *vend)
 {
+  int i;
+
   initlock(&kmem.lock, "kmem");
+  initlock(&kmem.reflock, "kref");
+  for(i = 0; i < NCPU; i++)
+    initlock(&kmem.cpu[i].lock, "kcache");
   kmem.use_lock = 0;
   freerange(vstart, vend);
 }
 
+//
+// kinit2() also gives the top BUDDYSIZE bytes, aligned to the largest
+// buddy block, to the buddy allocator (buddy.c), and keeps the first
+// pages for kmem.ref[].
 void
 kinit2(void *vstart, void *vend)
 {
-  freerange(vstart, vend);
+  char *b;
+  uint n;
+
+  n = V2P(vend) / PGSIZE * sizeof(kmem.ref[0]);
+  kmem.ref = (ushort*)PGROUNDUP((uint)vstart);
+  memset(kmem.ref, 0, n);
+  vstart = (char*)kmem.ref + PGROUNDUP(n);
+
+  b = (char*)(((uint)vend - BUDDYSIZE) & ~((PGSIZE << MAXORDER) - 1));
+  if(b < (char*)vstart)
+    b = vend;
+  freerange(vstart, b);
+  buddyinit(b, vend);
   kmem.use_lock = 1;
 }
 
@@ -51,6 +113,25 @@ freerange(void *vstart, void *vend)
   for(; p + PGSIZE <= (char*)vend; p += PGSIZE)
     kfree(p);
 }
+
+// Move up to n pages from list *from to list *to.
+// Caller holds the locks protecting both lists.
+// Returns the number of pages moved.
+static int
+kmove(struct run **from, struct run **to, int n)
+{
+  struct run *r;
+  int i;
+
+  for(i = 0; i < n && *from; i++){
+    r = *from;
+    *from = r->next;
+    r->next = *to;
+    *to = r;
+  }
+  return i;
+}
+
 //PAGEBREAK: 21
 // Free the page of physical memory pointed at by v,
 // which normally should have been returned by a
@@ -59,38 +140,283 @@ freerange(void *vstart, void *vend)
 void
 kfree(char *v)
 {
-  struct run *r;
+  struct run *r, *spill;
+  struct kcache *c;
+  int n;
 
-  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
+  if((uint)v % PGSIZE || v < end || V2P(v) >= phystop)
     panic("kfree");
 
+  if(kmem.ref && kmem.ref[V2P(v)/PGSIZE]){
+    acquire(&kmem.reflock);
+    if(kmem.ref[V2P(v)/PGSIZE] > 0){
+      kmem.ref[V2P(v)/PGSIZE]--;
+      release(&kmem.reflock);
+      return;
+    }
+    release(&kmem.reflock);
+  }
+
+  if(isbuddy(v)){
+    kfree_order(v, 0);
+    return;
+  }
+
   // Fill with junk to catch dangling refs.
-  memset(v, 1, PGSIZE);
+  if(KPOISON)
+    memset(v, 1, PGSIZE);
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
   r = (struct run*)v;
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  if(kmem.use_lock)
+  if(!kmem.use_lock){
+    // Still booting on one cpu; cpus[] may not be set up yet.
+    r->next = kmem.freelist;
+    kmem.freelist = r;
+    kmem.nfree++;
+    return;
+  }
+
+  pushcli();
+  c = &kmem.cpu[cpuid()];
+  acquire(&c->lock);
+  r->next = c->freelist;
+  c->freelist = r;
+  c->nfree++;
+  spill = 0;
+  if(c->nfree > KMAG){
+    c->nfree -= kmove(&c->freelist, &spill, KBATCH);
+    c->spills++;
+  }
+  release(&c->lock);
+
+  // Lock order is kmem.lock before any kcache lock,
+  // so hand the batch over only after dropping c->lock.
+  if(spill){
+    acquire(&kmem.lock);
+    n = kmove(&spill, &kmem.freelist, KBATCH);
+    kmem.nfree += n;
     release(&kmem.lock);
+  }
+  popcli();
+}
+
+// Add a reference to page v, which the caller already holds
+// one on. Each kref() needs a matching kfree(). A page has at
+// most one reference per mmap() region (NPROC*NVMA in all),
+// which a ushort count holds.
+void
+kref(char *v)
+{
+  uint i;
+
+  if((uint)v % PGSIZE || v < end || V2P(v) >= phystop || kmem.ref == 0)
+    panic("kref");
+  i = V2P(v) / PGSIZE;
+  acquire(&kmem.reflock);
+  if(kmem.ref[i] == 0xffff)
+    panic("kref: too many references");
+  kmem.ref[i]++;
+  release(&kmem.reflock);
+}
+
+// Take pages from other cpus' caches when the global
+// list is empty. Caller holds kmem.lock.
+static void
+ksteal(struct kcache *self)
+{
+  struct kcache *c;
+  int n;
+
+  for(c = kmem.cpu; c < &kmem.cpu[ncpu] && kmem.freelist == 0; c++){
+    if(c == self)
+      continue;
+    acquire(&c->lock);
+    n = kmove(&c->freelist, &kmem.freelist, KBATCH);
+    c->nfree -= n;
+    kmem.nfree += n;
+    release(&c->lock);
+  }
+}
+
+// Pop a page off the global zeroed pool, or return 0.
+// Used by kalloc() once everything else is gone, so it
+// also takes the zeroed pages that cpus have cached.
+static struct run*
+kzeropop(void)
+{
+  struct kcache *c;
+  struct run *r;
+  int n;
+
+  acquire(&kmem.lock);
+  for(c = kmem.cpu; c < &kmem.cpu[ncpu] && kmem.zerolist == 0; c++){
+    acquire(&c->lock);
+    n = kmove(&c->zerolist, &kmem.zerolist, KBATCH);
+    c->nzero -= n;
+    kmem.nzero += n;
+    release(&c->lock);
+  }
+  r = kmem.zerolist;
+  if(r){
+    kmem.zerolist = r->next;
+    kmem.nzero--;
+  }
+  release(&kmem.lock);
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
+// The contents are garbage; see kalloc_zeroed().
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
 char*
 kalloc(void)
 {
   struct run *r;
+  struct kcache *c;
+  int n;
+
+  if(!kmem.use_lock){
+    r = kmem.freelist;
+    if(r){
+      kmem.freelist = r->next;
+      kmem.nfree--;
+    }
+    return (char*)r;
+  }
 
-  if(kmem.use_lock)
+  pushcli();
+  c = &kmem.cpu[cpuid()];
+  acquire(&c->lock);
+  if(c->freelist){
+    c->hits++;
+  } else {
+    c->misses++;
+    release(&c->lock);
+    // Lock order is kmem.lock before any kcache lock.
     acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  if(kmem.use_lock)
+    if(kmem.freelist == 0)
+      ksteal(c);
+    acquire(&c->lock);
+    n = kmove(&kmem.freelist, &c->freelist, KBATCH);
+    kmem.nfree -= n;
+    c->nfree += n;
     release(&kmem.lock);
+  }
+  r = c->freelist;
+  if(r){
+    c->freelist = r->next;
+    c->nfree--;
+  }
+  release(&c->lock);
+  if(r == 0)
+    r = kzeropop();
+  if(r == 0)
+    r = (struct run*)kalloc_order(0);
+  popcli();
   return (char*)r;
 }
 
+// Allocate one zero-filled page, preferably from the
+// pool that idle cpus have already cleared.
+// Returns 0 if the memory cannot be allocated.
+char*
+kalloc_zeroed(void)
+{
+  struct run *r;
+  struct kcache *c;
+  int n;
+  char *v;
+
+  if(kmem.use_lock){
+    pushcli();
+    c = &kmem.cpu[cpuid()];
+    acquire(&c->lock);
+    if(c->zerolist == 0){
+      release(&c->lock);
+      acquire(&kmem.lock);
+      acquire(&c->lock);
+      n = kmove(&kmem.zerolist, &c->zerolist, KBATCH);
+      kmem.nzero -= n;
+      c->nzero += n;
+      release(&kmem.lock);
+    }
+    r = c->zerolist;
+    if(r){
+      c->zerolist = r->next;
+      c->nzero--;
+      c->zhits++;
+    } else
+      c->zmisses++;
+    release(&c->lock);
+    popcli();
+    if(r){
+      r->next = 0;
+      return (char*)r;
+    }
+  }
+
+  if((v = kalloc()) != 0)
+    memset(v, 0, PGSIZE);
+  return v;
+}
+
+// Zero one page from the global free list and move it to the
+// zeroed pool. Called by the scheduler when it finds nothing
+// to run. Returns 0 if there was no work to do.
+int
+kzero(void)
+{
+  struct run *r;
+
+  if(!kmem.use_lock)
+    return 0;
+  acquire(&kmem.lock);
+  if(kmem.nzero >= KZEROMAX || (r = kmem.freelist) == 0){
+    release(&kmem.lock);
+    return 0;
+  }
+  kmem.freelist = r->next;
+  kmem.nfree--;
+  release(&kmem.lock);
+
+  memset(r, 0, PGSIZE);
+
+  acquire(&kmem.lock);
+  r->next = kmem.zerolist;
+  kmem.zerolist = r;
+  kmem.nzero++;
+  release(&kmem.lock);
+  return 1;
+}
+
+// Number of free pages on the lists and in the cpu caches.
+// No lock: the answer is out of date at once anyway.
+uint
+kfreecount(void)
+{
+  struct kcache *c;
+  uint n;
+
+  n = kmem.nfree + kmem.nzero;
+  for(c = kmem.cpu; c < &kmem.cpu[ncpu]; c++)
+    n += c->nfree + c->nzero;
+  return n;
+}
+
+//PAGEBREAK: 16
+// Print allocator statistics to console.  For debugging.
+// Runs when user types ^P on console.
+// No lock to avoid wedging a stuck machine further.
+void
+kallocdump(void)
+{
+  struct kcache *c;
+
+  cprintf("kmem: %d pages on global list, %d pre-zeroed\n",
+          kmem.nfree, kmem.nzero);
+  for(c = kmem.cpu; c < &kmem.cpu[ncpu]; c++)
+    cprintf("  cpu%d: cached %d+%d zeroed, kalloc hits %d misses %d, "
+            "kfree spills %d, zeroed hits %d misses %d\n",
+            c - kmem.cpu, c->nfree, c->nzero, c->hits, c->misses,
+            c->spills, c->zhits, c->zmisses);
+}
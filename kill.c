@@ -13,7 +13,11 @@ main(int argc, char **argv)
   }
   //for(i=1; i<argc; i++)
   // kill(atoi(argv[1]), 19); // for debugging
-  kill(atoi(argv[1]), atoi(argv[2]));
+  // "kill -N sig" signals every process in process group N.
+  if(argv[1][0] == '-')
+    kill(-atoi(argv[1]+1), atoi(argv[2]));
+  else
+    kill(atoi(argv[1]), atoi(argv[2]));
 
   exit();
 }
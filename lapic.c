@@ -163,6 +163,10 @@ lapicstartap(uchar apicid, uint addr)
 #define CMOS_STATA   0x0a
 #define CMOS_STATB   0x0b
 #define CMOS_UIP    (1 << 7)        // RTC update in progress
+#define CMOS_EXTLO   0x30           // KB of memory above 1 MB (to 64 MB)
+#define CMOS_EXTHI   0x31
+#define CMOS_EXT16LO 0x34           // 64 KB blocks above 16 MB
+#define CMOS_EXT16HI 0x35
 
 #define SECS    0x00
 #define MINS    0x02
@@ -179,6 +183,22 @@ static uint cmos_read(uint reg)
   return inb(CMOS_RETURN);
 }
 
+// Size of physical memory in KB, as the BIOS left it in the
+// CMOS, or 0 if it left nothing there.
+uint
+cmosmemsize(void)
+{
+  uint ext, ext16;
+
+  ext = cmos_read(CMOS_EXTLO) | cmos_read(CMOS_EXTHI) << 8;
+  ext16 = cmos_read(CMOS_EXT16LO) | cmos_read(CMOS_EXT16HI) << 8;
+  if(ext16)
+    return 16*1024 + ext16*64;
+  if(ext)
+    return 1024 + ext;
+  return 0;
+}
+
 static void fill_rtcdate(struct rtcdate *r)
 {
   r->second = cmos_read(SECS);
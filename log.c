@@ -1,6 +1,8 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
+#include "proc.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
@@ -9,46 +11,102 @@
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
+// calls. The logging system only closes a transaction when there
+// are no FS system calls active. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// its start and end, or begin_opn(n) instead of begin_op() if it
+// writes at most n blocks, fewer than MAXOPBLOCKS. Usually
+// begin_opn() just reserves n blocks of log space for the call
+// and returns. But if the open transaction has no room for them
+// left, it sleeps until the transaction has been closed. Each
+// block that log_write() adds to the transaction uses up one
+// block of the call's reservation; end_op() returns the rest.
+//
+// Only metadata goes through the log (ordered mode): writei()
+// hands blocks of file data to log_write_data() instead, and they
+// are written to their home locations just before the transaction
+// commits, so that committed metadata never points at blocks that
+// were not written. begin_opdata() reserves room for them.
+// For the same reason, balloc() does not hand out a block that the
+// open transaction freed (log_freed()): until that transaction
+// commits, the block belongs to a file on disk, and an in-place
+// write to it would clobber that file.
+//
+// The log is split in two regions. Closing a transaction copies
+// its blocks into a free region's memory and hands it to a flusher
+// kernel thread, which writes the region to disk (the commit),
+// then copies the blocks to their home locations (the install)
+// and frees the region. New operations go into the next
+// transaction meanwhile; while neither region is free, everything
+// that ends is batched into that transaction, which is closed as
+// soon as a region frees up (group commit). The blocks stay
+// pinned in the buffer cache until they are installed.
+// end_op() does not wait for any of this; fsync() waits for the
+// transaction holding the caller's changes to commit.
 //
 // The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
+// The on-disk format of each region:
+//   header block, containing a sequence number, a checksum
+//     of the blocks and block #s for block A, B, C, ...
 //   block A
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// A commit writes the header and the blocks together, in one disk
+// command as a rule, so the disk may write them in any order; a
+// region whose blocks do not match the checksum in its header never
+// committed. At boot, committed regions are installed in sequence
+// order.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
   int n;
+  uint seq;
+  uint sum;        // logsum() of the blocks
   int block[LOGSIZE];
 };
 
+// A log region and the transaction it holds.
+struct region {
+  int state;              // RFREE, RCLOSED or RCOMMITTED
+  struct logheader lh;
+  // Its blocks, as they were when closed. Each is a DMA buffer
+  // that must not cross a 64 KB boundary (ide.c), hence aligned.
+  uchar data[LOGSIZE*BSIZE] __attribute__((aligned(BSIZE)));
+  int ndata;
+  uint dblock[LOGDATA];   // file data blocks to write before the commit
+};
+
+enum { RFREE, RCLOSED, RCOMMITTED };
+
 struct log {
   struct spinlock lock;
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // log blocks they may still add
+  int dreserved;   // ... and file data blocks
+  int committing;  // in closetrans(), please wait.
   int dev;
-  struct logheader lh;
+  struct logheader lh;  // the open transaction
+  int ndata;            // ... and its file data blocks
+  uint dblock[LOGDATA];
+  int nfreed;           // ... and the blocks it freed, a bitmap
+  uchar freed[(FSSIZE+7)/8];
+  struct region region[2];
+  uint seq;        // transactions closed
+  uint ncommit;    // ... and committed
+  struct buf wbuf[LOGSIZE+1];  // for the flusher's writes
+  uchar hdr[BSIZE] __attribute__((aligned(BSIZE)));  // header block for wbuf
 };
 struct log log;
 
 static void recover_from_log(void);
-static void commit();
+static void flusher(void);
 
 void
 initlog(int dev)
@@ -57,23 +115,37 @@ initlog(int dev)
     panic("initlog: too big logheader");
 
   struct superblock sb;
+  int i;
+
   initlock(&log.lock, "log");
   readsb(dev, &sb);
   log.start = sb.logstart;
-  log.size = sb.nlog;
+  log.size = sb.nlog / 2;   // per region
   log.dev = dev;
+  if (log.size < 2)
+    panic("initlog: log too small");
+  for (i = 0; i < LOGSIZE+1; i++)
+    initsleeplock(&log.wbuf[i].lock, "logwbuf");
   recover_from_log();
+  kthread("flusher", flusher);
+}
+
+// First block of region r.
+static uint
+rstart(int r)
+{
+  return log.start + r*log.size;
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks from region r to their home location
 static void
-install_trans(void)
+install_trans(int r, struct logheader *lh)
 {
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
+  for (tail = 0; tail < lh->n; tail++) {
+    struct buf *lbuf = bread(log.dev, rstart(r)+tail+1); // read log block
+    struct buf *dbuf = bread(log.dev, lh->block[tail]); // read dst
     memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
     bwrite(dbuf);  // write dst to disk
     brelse(lbuf);
@@ -81,129 +153,397 @@ install_trans(void)
   }
 }
 
-// Read the log header from disk into the in-memory log header
+#define SUMSTART 2166136261U
+
+// Checksum h extended over the n blocks at data (FNV-1a over
+// words). Start with SUMSTART.
+static uint
+logsum(uint h, uchar *data, int n)
+{
+  uint *w = (uint*)data;
+  int i;
+
+  for (i = 0; i < n*BSIZE/4; i++)
+    h = (h ^ w[i]) * 16777619;
+  return h;
+}
+
+// Set up log.wbuf[i] to write data to block blockno.
 static void
-read_head(void)
+setwbuf(int i, uint blockno, uchar *data)
+{
+  log.wbuf[i].dev = log.dev;
+  log.wbuf[i].blockno = blockno;
+  log.wbuf[i].data = data;
+}
+
+// Write log.wbuf[0..n) to disk, bypassing the buffer cache.
+// iderwv() queues them together, so that runs of adjacent
+// blocks go out as single commands.
+static void
+write_blocks(int n)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+
+  for (i = 0; i < n; i++) {
+    acquiresleep(&log.wbuf[i].lock);
+    log.wbuf[i].flags = B_DIRTY;
   }
-  brelse(buf);
+  iderwv(log.wbuf, n);
+  for (i = 0; i < n; i++)
+    releasesleep(&log.wbuf[i].lock);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Copy the blocks of committed region g to their home locations,
+// for the flusher. Their cached copies may already hold changes
+// of a later transaction, so the blocks go out from g->data.
+// Each cached copy was pinned by log_write() and is unpinned
+// once written.
 static void
-write_head(void)
+install(struct region *g)
 {
-  struct buf *buf = bread(log.dev, log.start);
+  struct buf *dbuf;
+  int tail;
+
+  for (tail = 0; tail < g->lh.n; tail++)
+    setwbuf(tail, g->lh.block[tail], g->data + tail*BSIZE);
+  write_blocks(g->lh.n);
+  for (tail = 0; tail < g->lh.n; tail++) {
+    dbuf = bread(log.dev, g->lh.block[tail]);
+    bunpin(dbuf);
+    brelse(dbuf);
+  }
+}
+
+// Write the file data blocks of closed region g in place and
+// wait for them, before it commits. They go out from the buffer
+// cache, where log_write_data() pinned them, as B_ASYNC writes
+// so that the disk gets all of them at once; bread() waits for
+// each until ideintr() has released it.
+static void
+write_data(struct region *g)
+{
+  struct buf *b;
+  int i;
+
+  for (i = 0; i < g->ndata; i++) {
+    b = bread(log.dev, g->dblock[i]);
+    b->flags |= B_DIRTY|B_ASYNC;
+    iderw(b);
+  }
+  for (i = 0; i < g->ndata; i++) {
+    b = bread(log.dev, g->dblock[i]);
+    bunpin(b);
+    brelse(b);
+  }
+}
+
+// Read the header of region r from disk into lh
+static void
+read_head(int r, struct logheader *lh)
+{
+  struct buf *buf = bread(log.dev, rstart(r));
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  lh->n = hb->n;
+  lh->seq = hb->seq;
+  lh->sum = hb->sum;
+  for (i = 0; i < lh->n; i++) {
+    lh->block[i] = hb->block[i];
   }
-  bwrite(buf);
   brelse(buf);
 }
 
+// Set up log.wbuf[0] to write header lh to region r.
+// Writing it is the true point at which the
+// transaction in r commits.
+static void
+head_wbuf(int r, struct logheader *lh)
+{
+  struct logheader *hb = (struct logheader *) log.hdr;
+  int i;
+  hb->n = lh->n;
+  hb->seq = lh->seq;
+  hb->sum = lh->sum;
+  for (i = 0; i < lh->n; i++) {
+    hb->block[i] = lh->block[i];
+  }
+  setwbuf(0, rstart(r), log.hdr);
+}
+
+// Write header lh to region r, and n blocks from data after it.
+static void
+write_head(int r, struct logheader *lh, uchar *data, int n)
+{
+  int i;
+
+  head_wbuf(r, lh);
+  for (i = 0; i < n; i++)
+    setwbuf(i+1, rstart(r)+1+i, data + i*BSIZE);
+  write_blocks(n+1);
+}
+
+// Do the blocks of region r, whose header is in lh,
+// match its checksum? Used at boot.
+static int
+check_trans(int r, struct logheader *lh)
+{
+  struct buf *lbuf;
+  uint h = SUMSTART;
+  int tail;
+
+  for (tail = 0; tail < lh->n; tail++) {
+    lbuf = bread(log.dev, rstart(r)+tail+1);
+    h = logsum(h, lbuf->data, 1);
+    brelse(lbuf);
+  }
+  return h == lh->sum;
+}
+
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(); // if committed, copy from log to disk
+  struct logheader *lh0 = &log.region[0].lh, *lh1 = &log.region[1].lh;
+  int first;
+
+  read_head(0, lh0);
+  read_head(1, lh1);
+  if (!check_trans(0, lh0))
+    lh0->n = 0;
+  if (!check_trans(1, lh1))
+    lh1->n = 0;
+  // if committed, copy from log to disk, older region first
+  first = lh1->n > 0 && (lh0->n == 0 || (int)(lh1->seq - lh0->seq) < 0);
+  install_trans(first, &log.region[first].lh);
+  install_trans(!first, &log.region[!first].lh);
+  log.seq = log.ncommit = (int)(lh1->seq - lh0->seq) > 0 ? lh1->seq : lh0->seq;
+  lh0->n = lh1->n = 0;
+  write_head(0, lh0, 0, 0); // clear the log
+  write_head(1, lh1, 0, 0);
+}
+
+// Does the open transaction hold anything? Caller holds log.lock.
+static int
+opentrans(void)
+{
+  return log.lh.n > 0 || log.ndata > 0;
+}
+
+// Index of a free region, or -1. Caller holds log.lock.
+static int
+freeregion(void)
+{
+  int r;
+
+  for (r = 0; r < 2; r++)
+    if (log.region[r].state == RFREE)
+      return r;
+  return -1;
+}
+
+// Copy the open transaction into free region r and hand it to
+// the flusher. The caller has set log.committing, so no operation
+// is in progress and none can start.
+static void
+closetrans(int r)
+{
+  struct region *g = &log.region[r];
+  struct buf *b;
+  int tail;
+
+  for (tail = 0; tail < log.lh.n; tail++) {
+    b = bread(log.dev, log.lh.block[tail]); // cache block
+    memmove(g->data + tail*BSIZE, b->data, BSIZE);
+    brelse(b);
+  }
+  acquire(&log.lock);
+  g->lh = log.lh;
+  g->lh.seq = ++log.seq;
+  g->lh.sum = logsum(SUMSTART, g->data, g->lh.n);
+  g->ndata = log.ndata;
+  memmove(g->dblock, log.dblock, log.ndata*sizeof(uint));
+  g->state = RCLOSED;
   log.lh.n = 0;
-  write_head(); // clear the log
+  log.ndata = 0;
+  if (log.nfreed > 0) {
+    memset(log.freed, 0, sizeof(log.freed));
+    log.nfreed = 0;
+  }
+  log.committing = 0;
+  wakeup(&log);
+  wakeup(&log.region);
+  release(&log.lock);
 }
 
-// called at the start of each FS system call.
+// Pick the flusher's next region: commit closed transactions
+// first, then install committed ones, oldest first. But a closed
+// transaction with file data waits until the older one has been
+// installed: the install might overwrite a block that the older
+// transaction freed and the newer one reused for data.
+// Caller holds log.lock.
+static int
+nextregion(void)
+{
+  struct region *g = log.region;
+  int old;
+
+  if (g[0].state == RFREE && g[1].state == RFREE)
+    return -1;
+  if (g[0].state == RFREE || g[1].state == RFREE)
+    return g[0].state == RFREE;
+  old = (int)(g[1].lh.seq - g[0].lh.seq) < 0;
+  if (g[old].state == RCOMMITTED && g[!old].state == RCLOSED && g[!old].ndata == 0)
+    return !old;
+  return old;
+}
+
+// The flusher kernel thread: commit each closed transaction,
+// install it, then free its region for the next one.
+static void
+flusher(void)
+{
+  struct logheader empty;
+  struct region *g;
+  int r, close;
+
+  empty.n = 0;
+  empty.seq = 0;
+  empty.sum = 0;
+  for(;;){
+    acquire(&log.lock);
+    while((r = nextregion()) < 0)
+      sleep(&log.region, &log.lock);
+    release(&log.lock);
+    g = &log.region[r];
+
+    if (g->state == RCLOSED) {
+      write_data(g);           // File data goes in place first
+      // Write header and blocks to disk -- the real commit
+      if (g->lh.n > 0)
+        write_head(r, &g->lh, g->data, g->lh.n);
+      acquire(&log.lock);
+      g->state = RCOMMITTED;
+      log.ncommit = g->lh.seq;
+      wakeup(&log);
+      release(&log.lock);
+      continue;
+    }
+
+    if (g->lh.n > 0) {
+      install(g);              // Now install writes to home locations
+      write_head(r, &empty, 0, 0);  // Erase the transaction from the log
+    }
+    acquire(&log.lock);
+    g->state = RFREE;
+    // A transaction left open for want of a region can close now.
+    close = !log.committing && log.outstanding == 0 && opentrans();
+    if (close)
+      log.committing = 1;
+    wakeup(&log);
+    release(&log.lock);
+    if (close)
+      closetrans(r);
+  }
+}
+
+// called at the start of each FS system call that writes
+// at most n blocks through the log and nd blocks of file data.
 void
-begin_op(void)
+begin_opdata(int n, int nd)
 {
+  struct proc *p = myproc();
+
+  if(n > MAXOPBLOCKS || nd > LOGDATA)
+    panic("begin_opdata");
   acquire(&log.lock);
   while(1){
     if(log.committing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh.n + log.reserved + n > log.size - 1 ||
+              log.ndata + log.dreserved + nd > LOGDATA){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += n;
+      log.dreserved += nd;
+      p->logresv = n;
+      p->logdresv = nd;
       release(&log.lock);
       break;
     }
   }
 }
 
+// called at the start of each FS system call that writes
+// at most n blocks and no file data.
+void
+begin_opn(int n)
+{
+  begin_opdata(n, 0);
+}
+
+// called at the start of each FS system call.
+void
+begin_op(void)
+{
+  begin_opn(MAXOPBLOCKS);
+}
+
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// closes the open transaction if this was the last outstanding
+// operation and a log region is free.
 void
 end_op(void)
 {
-  int do_commit = 0;
+  struct proc *p = myproc();
+  int r = -1;
 
   acquire(&log.lock);
   log.outstanding -= 1;
+  log.reserved -= p->logresv;
+  log.dreserved -= p->logdresv;
+  p->logresv = 0;
+  p->logdresv = 0;
   if(log.committing)
     panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
+  if(log.outstanding == 0 && opentrans() && (r = freeregion()) >= 0){
     log.committing = 1;
   } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
+    // begin_opn() may be waiting for log space,
+    // and the unused part of this op's reservation
+    // has been given back.
     wakeup(&log);
   }
   release(&log.lock);
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
+  if(r >= 0){
+    // call closetrans w/o holding locks, since not allowed
     // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
+    closetrans(r);
   }
 }
 
-// Copy modified blocks from cache to log.
-static void
-write_log(void)
+// Wait until the operations that have ended are on disk,
+// committing the transaction they belong to first. For fsync().
+void
+log_sync(void)
 {
-  int tail;
-
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
-  }
-}
+  uint want;
 
-static void
-commit()
-{
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
-  }
+  acquire(&log.lock);
+  want = log.seq;
+  if(opentrans())
+    want++;
+  while((int)(log.ncommit - want) < 0)
+    sleep(&log, &log.lock);
+  release(&log.lock);
 }
 
 // Caller has modified b->data and is done with the buffer.
-// Record the block number and pin in the cache with B_DIRTY.
-// commit()/write_log() will do the disk write.
+// Record the block number and pin it in the cache (bpin()) until
+// the flusher has installed it. The flusher will do the disk
+// writes.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -213,6 +553,7 @@ commit()
 void
 log_write(struct buf *b)
 {
+  struct proc *p = myproc();
   int i;
 
   if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
@@ -226,9 +567,77 @@ log_write(struct buf *b)
       break;
   }
   log.lh.block[i] = b->blockno;
-  if (i == log.lh.n)
+  if (i == log.lh.n) {
+    // Use up the op's reservation; past it, only log space
+    // that no other op has reserved will do.
+    if (p->logresv > 0) {
+      p->logresv--;
+      log.reserved--;
+    } else if (log.lh.n + log.reserved >= log.size - 1)
+      panic("log_write: op over its reservation");
     log.lh.n++;
-  b->flags |= B_DIRTY; // prevent eviction
+    bpin(b);  // prevent eviction
+  }
+  release(&log.lock);
+}
+
+// Like log_write(), but for a block of file data, which is written
+// in place just before the transaction commits rather than through
+// the log. A block that is in the log already stays there.
+void
+log_write_data(struct buf *b)
+{
+  struct proc *p = myproc();
+  int i;
+
+  if (log.outstanding < 1)
+    panic("log_write_data outside of trans");
+
+  acquire(&log.lock);
+  for (i = 0; i < log.lh.n; i++)
+    if (log.lh.block[i] == b->blockno)
+      break;
+  if (i == log.lh.n) {
+    for (i = 0; i < log.ndata; i++)
+      if (log.dblock[i] == b->blockno)
+        break;
+    if (i == log.ndata) {
+      if (p->logdresv > 0) {
+        p->logdresv--;
+        log.dreserved--;
+      } else if (log.ndata + log.dreserved >= LOGDATA)
+        panic("log_write_data: op over its reservation");
+      log.dblock[log.ndata++] = b->blockno;
+      bpin(b);  // prevent eviction
+    }
+  }
   release(&log.lock);
 }
 
+// Record that the open transaction frees block b, for bfree().
+void
+log_free(uint b)
+{
+  if (b >= FSSIZE)
+    panic("log_free");
+  acquire(&log.lock);
+  log.freed[b/8] |= 1 << (b%8);
+  log.nfreed++;
+  release(&log.lock);
+}
+
+// Did the open transaction free block b? balloc() must not
+// reuse it before the transaction commits; by the time the next
+// one does, the flusher has committed this one (nextregion()).
+int
+log_freed(uint b)
+{
+  int r;
+
+  if (b >= FSSIZE)
+    return 0;
+  acquire(&log.lock);
+  r = (log.freed[b/8] & (1 << (b%8))) != 0;
+  release(&log.lock);
+  return r;
+}
@@ -0,0 +1,71 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "x86.h"
+
+#define PGSIZE 4096
+#define ROUNDS 256
+
+/*
+* Page copy and page zero throughput.
+*
+* Times ROUNDS page-sized copies and clears done with byte-at-a-time
+* loops (what memmove() and memset() used to be) and with the
+* current dword-wide ulib versions, and prints cycles per page.
+* The kernel's string.c uses the same code as ulib.c.
+*/
+
+char src[PGSIZE] __attribute__((aligned(PGSIZE)));
+char dst[PGSIZE] __attribute__((aligned(PGSIZE)));
+
+void
+bytecopy(char *d, char *s, int n){
+    while(n-- > 0)
+        *d++ = *s++;
+}
+
+void
+bytezero(char *d, int n){
+    while(n-- > 0)
+        *d++ = 0;
+}
+
+uint
+run(int which){
+    uint start;
+    int i;
+
+    start = rdtsc();
+    for(i = 0; i < ROUNDS; i++){
+        switch(which){
+            case 0: bytecopy(dst, src, PGSIZE); break;
+            case 1: memmove(dst, src, PGSIZE); break;
+            case 2: bytezero(dst, PGSIZE); break;
+            default: memset(dst, 0, PGSIZE);
+        }
+    }
+    return (rdtsc() - start) / ROUNDS;
+}
+
+int
+main(void){
+    uint bcopy, wcopy, bzero, wzero;
+    int i;
+
+    memset(src, 0x5a, PGSIZE);
+    run(1);  // fault in and warm up both pages
+    for(i = 0; i < PGSIZE; i++)
+        if(dst[i] != 0x5a){
+            printf(2, "membench: memmove copied wrong byte %d\n", i);
+            exit();
+        }
+
+    bcopy = run(0);
+    wcopy = run(1);
+    bzero = run(2);
+    wzero = run(3);
+    printf(1, "cycles per 4KB page:\n");
+    printf(1, "  copy: byte loop %d, memmove %d\n", bcopy, wcopy);
+    printf(1, "  zero: byte loop %d, memset %d\n", bzero, wzero);
+    exit();
+}
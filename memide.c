@@ -57,4 +57,18 @@ iderw(struct buf *b)
   } else
     memmove(b->data, p, BSIZE);
   b->flags |= B_VALID;
+  if(b->flags & B_ASYNC){
+    b->flags &= ~B_ASYNC;
+    bdone(b);
+  }
+}
+
+// Sync the n bufs b[0..n) with disk.
+void
+iderwv(struct buf *b, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    iderw(&b[i]);
 }
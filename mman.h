@@ -0,0 +1,10 @@
+// Arguments to mmap().
+// Both the kernel and user programs use this header file.
+#define PROT_READ   0x1   // pages may be read
+#define PROT_WRITE  0x2   // pages may be written
+
+#define MAP_SHARED  0x01  // share with forked children; write back to the file
+#define MAP_PRIVATE 0x02  // private copy, filled on first touch
+#define MAP_ANON    0x20  // not backed by a file; starts zeroed
+
+#define MAP_FAILED  ((void*)-1)
@@ -0,0 +1,605 @@
+// Memory-mapped regions: mmap() and munmap().
+//
+// A process has up to NVMA regions, placed top-down from KERNBASE
+// so that they stay clear of the heap growing up from p->sz.
+// Private regions are filled a page at a time on first touch: by
+// the page fault handler (mmapfault()), or by argptr() before the
+// kernel itself reads or writes the pages (mmapprefault()).
+// Shared anonymous regions are filled when they are mapped, so that
+// fork() can give the child the very same pages (mmapfork(), using
+// kref()). Shared file regions are filled on first touch too, from
+// fpages: one page per (inode, offset), found through a hash table,
+// mapped by every process that maps that part of the file and kept
+// up to date by read() and write() (mmapread(), mmapwrite()). A page
+// dirtied through any mapping is written back to the file when the
+// last mapping of it goes away: on munmap(), exec or exit.
+// Shared-memory segments (shm.c) are regions too, mapped in full by
+// shmattach() and carrying a reference to their segment.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "stat.h"
+#include "fs.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "mman.h"
+
+#define FPHASH   64   // fpages hash buckets, a power of two
+
+// A page of a shared file mapping.
+struct fpage {
+  struct inode *ip;       // 0 if the slot is free
+  uint off;               // page-aligned offset in the file
+  char *mem;
+  int ref;                // page table entries mapping mem
+  int pin;                // mmapread()/mmapwrite() calls copying it
+  int dirty;              // written through a mapping since writeback
+  int busy;               // being written back after ref went to 0
+  struct fpage *next;     // hash chain, or free list
+};
+
+struct {
+  struct spinlock lock;
+  int n;                  // slots in use
+  struct fpage page[NFPAGE];
+  struct fpage *hash[FPHASH];
+  struct fpage *free;
+} fpages;
+
+#define FPBUCKET(ip, off) \
+  (&fpages.hash[((uint)(ip) / 64 + (off) / PGSIZE) & (FPHASH - 1)])
+
+void
+mmapinit(void)
+{
+  struct fpage *fp;
+
+  initlock(&fpages.lock, "fpages");
+  for(fp = fpages.page; fp < &fpages.page[NFPAGE]; fp++){
+    fp->next = fpages.free;
+    fpages.free = fp;
+  }
+}
+
+// Return the region of p containing va, or 0.
+static struct vma*
+findvma(struct proc *p, uint va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end && va >= v->start && va < v->end)
+      return v;
+  return 0;
+}
+
+// Return a region of p overlapping [start, end), or 0.
+static struct vma*
+overlap(struct proc *p, uint start, uint end)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end && v->start < end && start < v->end)
+      return v;
+  return 0;
+}
+
+// Does [start, end) overlap any region of p?
+// Used to keep the heap out of mapped regions.
+int
+mmapoverlap(struct proc *p, uint start, uint end)
+{
+  return overlap(p, start, end) != 0;
+}
+
+// Caller holds fpages.lock.
+static struct fpage*
+fpagefind(struct inode *ip, uint off)
+{
+  struct fpage *fp;
+
+  for(fp = *FPBUCKET(ip, off); fp; fp = fp->next)
+    if(fp->ip == ip && fp->off == off)
+      return fp;
+  return 0;
+}
+
+// Take fp out of the table and return its page, which the
+// caller frees after releasing fpages.lock.
+static char*
+fpagefree(struct fpage *fp)
+{
+  struct fpage **pp;
+
+  for(pp = FPBUCKET(fp->ip, fp->off); *pp != fp; pp = &(*pp)->next)
+    ;
+  *pp = fp->next;
+  fp->ip = 0;
+  fp->next = fpages.free;
+  fpages.free = fp;
+  fpages.n--;
+  return fp->mem;
+}
+
+// Return the shared page for offset off of ip, with a reference
+// for the caller, reading it from the file if nobody has it yet.
+// Returns 0 if out of memory or slots.
+static char*
+fpageget(struct inode *ip, uint off)
+{
+  struct fpage *fp, **bp;
+  char *mem;
+
+  if((mem = swapalloc(1)) == 0)
+    return 0;
+  // The inode lock keeps read() and write() off the page while it
+  // is filled, and makes concurrent faults on it wait for that.
+  ilock(ip);
+  acquire(&fpages.lock);
+  if((fp = fpagefind(ip, off)) != 0 || fpages.free == 0){
+    if(fp)
+      fp->ref++;
+    release(&fpages.lock);
+    iunlock(ip);
+    kfree(mem);
+    return fp ? fp->mem : 0;
+  }
+  fp = fpages.free;
+  fpages.free = fp->next;
+  fp->ip = ip;
+  fp->off = off;
+  fp->mem = mem;
+  fp->ref = 1;
+  fp->pin = 0;
+  fp->dirty = 0;
+  fp->busy = 0;
+  bp = FPBUCKET(ip, off);
+  fp->next = *bp;
+  *bp = fp;
+  fpages.n++;
+  release(&fpages.lock);
+  // Past the end of the file, the page stays zero.
+  readi(ip, mem, off, PGSIZE);
+  iunlock(ip);
+  return mem;
+}
+
+// Take one more reference to shared page off of ip.
+static void
+fpagedup(struct inode *ip, uint off)
+{
+  acquire(&fpages.lock);
+  fpagefind(ip, off)->ref++;
+  release(&fpages.lock);
+}
+
+static void writeback(struct inode*, uint, char*);
+
+// Drop a reference to shared page off of ip; dirty says whether
+// it was written through the mapping going away. The last one
+// writes the page back if need be and frees it.
+static void
+fpageput(struct inode *ip, uint off, int dirty)
+{
+  struct fpage *fp;
+  char *mem;
+
+  acquire(&fpages.lock);
+  fp = fpagefind(ip, off);
+  if(dirty)
+    fp->dirty = 1;
+  if(--fp->ref > 0 || fp->busy){
+    release(&fpages.lock);
+    return;
+  }
+  // While writeback sleeps the page may be mapped again, and even
+  // dirtied and dropped again; busy makes the last of those leave
+  // the page to us.
+  fp->busy = 1;
+  while(fp->dirty && fp->ref == 0){
+    fp->dirty = 0;
+    release(&fpages.lock);
+    writeback(ip, off, fp->mem);
+    acquire(&fpages.lock);
+  }
+  fp->busy = 0;
+  mem = 0;
+  if(fp->ref == 0 && fp->pin == 0)
+    mem = fpagefree(fp);
+  release(&fpages.lock);
+  if(mem)
+    kfree(mem);
+}
+
+// Copy n bytes at offset off of ip, which lie within one page,
+// between the file's shared page and buf: out of the page if
+// towrite is 0 (read() must see what was stored through a mapping),
+// else into it (a mapping must see what write() stored). The copy
+// runs without fpages.lock, since buf may be user memory; the pin
+// keeps the page. Caller holds ip->lock.
+static void
+fpagecopy(struct inode *ip, uint off, char *buf, uint n, int towrite)
+{
+  struct fpage *fp;
+  char *mem;
+
+  if(fpages.n == 0)
+    return;
+  acquire(&fpages.lock);
+  if((fp = fpagefind(ip, PGROUNDDOWN(off))) != 0)
+    fp->pin++;
+  release(&fpages.lock);
+  if(fp == 0)
+    return;
+  mem = fp->mem + off % PGSIZE;
+  if(towrite)
+    memmove(mem, buf, n);
+  else
+    memmove(buf, mem, n);
+  acquire(&fpages.lock);
+  mem = 0;
+  if(--fp->pin == 0 && fp->ref == 0 && !fp->busy)
+    mem = fpagefree(fp);
+  release(&fpages.lock);
+  if(mem)
+    kfree(mem);
+}
+
+// Called by readi() after reading [off, off+n) of file ip into
+// dst; the range lies within one block.
+void
+mmapread(struct inode *ip, uint off, char *dst, uint n)
+{
+  fpagecopy(ip, off, dst, n, 0);
+}
+
+// Called by writei() after writing src to [off, off+n) of file ip;
+// the range lies within one block.
+void
+mmapwrite(struct inode *ip, uint off, char *src, uint n)
+{
+  fpagecopy(ip, off, src, n, 1);
+}
+
+// Allocate and map page va of region v in pgdir,
+// reading it from the file if there is one.
+static int
+fill(pde_t *pgdir, struct vma *v, uint va)
+{
+  char *mem;
+  uint off;
+  int perm;
+
+  if(v->shm)
+    return -1;
+  off = v->off + (va - v->start);
+  if(v->f && (v->flags & MAP_SHARED)){
+    if((mem = fpageget(v->f->ip, off)) == 0)
+      return -1;
+  } else {
+    if((mem = swapalloc(1)) == 0)
+      return -1;
+    if(v->f){
+      // Past the end of the file, the page stays zero.
+      ilock(v->f->ip);
+      readi(v->f->ip, mem, off, PGSIZE);
+      iunlock(v->f->ip);
+    }
+  }
+  perm = PTE_U;
+  if(v->prot & PROT_WRITE)
+    perm |= PTE_W;
+  if(mappages(pgdir, (char*)va, PGSIZE, V2P(mem), perm) < 0){
+    if(v->f && (v->flags & MAP_SHARED))
+      fpageput(v->f->ip, off, 0);
+    else
+      kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Write shared page off of ip, at mem, back to the file.
+// The file does not grow: bytes past its end are dropped.
+static void
+writeback(struct inode *ip, uint off, char *mem)
+{
+  int i, n, max;
+
+  // As in filewrite(), WRITECHUNK bytes per transaction.
+  max = WRITECHUNK;
+  for(i = 0; i < PGSIZE; i += n){
+    begin_opdata(WRITEBLOCKS, WRITEDATA(off + i, PGSIZE - i < max ? PGSIZE - i : max));
+    ilock(ip);
+    n = 0;
+    if(off + i < ip->size){
+      n = ip->size - (off + i);
+      if(n > max)
+        n = max;
+      if(n > PGSIZE - i)
+        n = PGSIZE - i;
+      writei(ip, mem + i, off + i, n);
+    }
+    iunlock(ip);
+    end_op();
+    if(n == 0)
+      break;
+  }
+}
+
+// Remove the pages of [start, end), part of region v, from pgdir.
+static void
+unmap(pde_t *pgdir, struct vma *v, uint start, uint end)
+{
+  pte_t *pte;
+  char *mem;
+  uint va;
+  int dirty;
+
+  for(va = start; va < end; va += PGSIZE){
+    if((pte = walkpgdir(pgdir, (char*)va, 0)) == 0 || (*pte & PTE_P) == 0)
+      continue;
+    mem = P2V(PTE_ADDR(*pte));
+    dirty = *pte & PTE_D;
+    *pte = 0;
+    if(v->f && (v->flags & MAP_SHARED))
+      fpageput(v->f->ip, v->off + (va - v->start), dirty);
+    else
+      kfree(mem);
+  }
+}
+
+static void
+vmafree(struct vma *v)
+{
+  if(v->f)
+    fileclose(v->f);
+  if(v->shm)
+    shmput(v->shm);
+  v->f = 0;
+  v->shm = 0;
+  v->start = v->end = 0;
+}
+
+// Claim a free region slot of p and place len bytes, rounded up
+// to pages, at the highest free range below KERNBASE. Sets start
+// and end; the caller fills in the rest. Returns 0 if there is no
+// free slot or no room.
+struct vma*
+vmaalloc(struct proc *p, uint len)
+{
+  struct vma *v, *o;
+  uint start;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end == 0)
+      break;
+  if(v == &p->vma[NVMA])
+    return 0;
+
+  len = PGROUNDUP(len);
+  start = KERNBASE - len;
+  while((o = overlap(p, start, start + len)) != 0){
+    if(o->start < len)
+      return 0;
+    start = o->start - len;
+  }
+  if(start < PGROUNDUP(p->sz))
+    return 0;
+
+  v->start = start;
+  v->end = start + len;
+  v->prot = 0;
+  v->flags = 0;
+  v->f = 0;
+  v->off = 0;
+  v->shm = 0;
+  return v;
+}
+
+// Map len bytes of f starting at offset off, or of zeroed memory
+// if flags has MAP_ANON. Returns the address of the region, or -1.
+int
+mmap(struct file *f, uint len, int prot, int flags, uint off)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint va;
+  int type;
+
+  type = flags & (MAP_SHARED|MAP_PRIVATE);
+  if(len == 0 || len >= KERNBASE || off % PGSIZE ||
+     (type != MAP_SHARED && type != MAP_PRIVATE))
+    return -1;
+  if(flags & MAP_ANON)
+    f = 0;
+  else {
+    if(f == 0 || f->type != FD_INODE || !f->readable)
+      return -1;
+    if(type == MAP_SHARED && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+    ilock(f->ip);
+    type = f->ip->type;
+    iunlock(f->ip);
+    if(type != T_FILE)
+      return -1;
+  }
+
+  if((v = vmaalloc(p, len)) == 0)
+    return -1;
+  v->prot = prot;
+  v->flags = flags;
+  v->f = f ? filedup(f) : 0;
+  v->off = off;
+
+  if(f == 0 && (flags & MAP_SHARED)){
+    for(va = v->start; va < v->end; va += PGSIZE){
+      if(fill(p->pgdir, v, va) < 0){
+        unmap(p->pgdir, v, v->start, va);
+        vmafree(v);
+        return -1;
+      }
+    }
+  }
+  return v->start;
+}
+
+// Unmap [addr, addr+len), which may cover several regions or
+// parts of them. Returns 0, or -1 if a region would have to be
+// split in two and there is no free slot for the second half.
+int
+munmap(uint addr, uint len)
+{
+  struct proc *p = myproc();
+  struct vma *v, *free;
+  uint end, s, e;
+  int split;
+
+  end = addr + PGROUNDUP(len);
+  if(addr % PGSIZE || len == 0 || end > KERNBASE || end <= addr)
+    return -1;
+
+  free = 0;
+  split = 0;
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end == 0 && free == 0)
+      free = v;
+    if(v->end && v->start < addr && v->end > end)
+      split = 1;
+  }
+  if(split && free == 0)
+    return -1;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end == 0 || v->end <= addr || v->start >= end)
+      continue;
+    s = v->start > addr ? v->start : addr;
+    e = v->end < end ? v->end : end;
+    unmap(p->pgdir, v, s, e);
+    if(s == v->start && e == v->end)
+      vmafree(v);
+    else if(s == v->start){
+      v->off += e - v->start;
+      v->start = e;
+    } else if(e == v->end)
+      v->end = s;
+    else {
+      *free = *v;
+      free->off += e - v->start;
+      free->start = e;
+      if(free->f)
+        filedup(free->f);
+      if(free->shm)
+        shmdup(free->shm);
+      v->end = s;
+    }
+  }
+  switchuvm(p);
+  return 0;
+}
+
+// Drop all of p's regions from pgdir, which is p->pgdir or,
+// in exec(), the page table p is leaving.
+void
+mmapclear(struct proc *p, pde_t *pgdir)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end == 0)
+      continue;
+    unmap(pgdir, v, v->start, v->end);
+    vmafree(v);
+  }
+}
+
+// Give child np copies of p's regions. Pages of shared regions
+// are mapped into both; pages of private ones are copied.
+// On failure the caller must mmapclear() np.
+int
+mmapfork(struct proc *p, struct proc *np)
+{
+  struct vma *v, *nv;
+  pte_t *pte;
+  uint va, pa, perm;
+  char *mem;
+
+  for(v = p->vma, nv = np->vma; v < &p->vma[NVMA]; v++, nv++){
+    if(v->end == 0)
+      continue;
+    *nv = *v;
+    if(nv->f)
+      filedup(nv->f);
+    if(nv->shm)
+      shmdup(nv->shm);
+    for(va = v->start; va < v->end; va += PGSIZE){
+      if((pte = walkpgdir(p->pgdir, (char*)va, 0)) == 0 || (*pte & PTE_P) == 0)
+        continue;
+      pa = PTE_ADDR(*pte);
+      perm = PTE_FLAGS(*pte) & (PTE_W|PTE_U);
+      if(v->flags & MAP_SHARED){
+        if(mappages(np->pgdir, (char*)va, PGSIZE, pa, perm) < 0)
+          return -1;
+        if(v->f)
+          fpagedup(v->f->ip, v->off + (va - v->start));
+        else
+          kref(P2V(pa));
+      } else {
+        if((mem = swapalloc(0)) == 0)
+          return -1;
+        memmove(mem, P2V(pa), PGSIZE);
+        if(mappages(np->pgdir, (char*)va, PGSIZE, V2P(mem), perm) < 0){
+          kfree(mem);
+          return -1;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+// Handle a page fault at va in p. Returns 0 if va was
+// an untouched page of a region and is now mapped.
+int
+mmapfault(struct proc *p, uint va, int write)
+{
+  struct vma *v;
+  pte_t *pte;
+
+  if((v = findvma(p, va)) == 0)
+    return -1;
+  if(write && !(v->prot & PROT_WRITE))
+    return -1;
+  if((pte = walkpgdir(p->pgdir, (char*)va, 0)) != 0 && (*pte & PTE_P))
+    return -1;
+  return fill(p->pgdir, v, PGROUNDDOWN(va));
+}
+
+// Make sure [addr, addr+len) lies in one region of p that allows
+// the access, and fill in its untouched pages, so that the kernel
+// can use it without faulting. Returns 0 if so, else -1.
+int
+mmapprefault(struct proc *p, uint addr, uint len, int write)
+{
+  struct vma *v;
+  pte_t *pte;
+  uint va;
+
+  if((v = findvma(p, addr)) == 0 || addr + len > v->end || addr + len < addr)
+    return -1;
+  if(write && !(v->prot & PROT_WRITE))
+    return -1;
+  for(va = PGROUNDDOWN(addr); va < addr + len; va += PGSIZE){
+    if((pte = walkpgdir(p->pgdir, (char*)va, 0)) != 0 && (*pte & PTE_P))
+      continue;
+    if(fill(p->pgdir, v, va) < 0)
+      return -1;
+  }
+  return 0;
+}
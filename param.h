@@ -2,13 +2,24 @@
 #define KSTACKSIZE 4096  // size of per-process kernel stack
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NVMA         16  // mmap() regions per process
+#define NSHM         16  // shared-memory segments per system
+#define NFPAGE      256  // pages of shared file mappings per system
+#define NSKEL         8  // kernel stacks and page directories cached per cpu
+#define SWAPDEV       0  // device number of swap area (the boot disk)
+#define SWAPSTART  2048  // first block of swap area, past the kernel
+#define NSWAPPG    4096  // size of swap area in pages
+#define NSWAPPIN      4  // user ranges a system call keeps swapped in
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
+#define IPUTBLOCKS    2  // ... one that only iput()s: bitmap and inode
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define LOGDATA      (LOGSIZE*2)  // max file data blocks per transaction
+#define NBUF         ((LOGSIZE+LOGDATA)*4)  // least size of disk block cache (bio.c)
 #define FSSIZE       1000  // size of file system in blocks
+#define KPOISON         0  // fill freed pages with junk (debugging)
+#define MAXORDER       10  // largest buddy block is 2^MAXORDER pages
+#define BUDDYSIZE (32*1024*1024)  // bytes of memory kept for the buddy allocator
 
@@ -92,6 +92,39 @@ allocpid(void)
 
 
 //PAGEBREAK: 32
+// Kernel stacks of dead processes stay in a small per-cpu
+// cache, from which allocproc() on that cpu takes them first.
+static char*
+kstackalloc(void)
+{
+  struct cpu *c;
+  char *kstack;
+
+  pushcli();
+  c = mycpu();
+  kstack = c->nkstack > 0 ? c->kstacks[--c->nkstack] : 0;
+  popcli();
+  if(kstack == 0)
+    kstack = kalloc();
+  return kstack;
+}
+
+static void
+kstackfree(char *kstack)
+{
+  struct cpu *c;
+
+  pushcli();
+  c = mycpu();
+  if(c->nkstack < NSKEL){
+    c->kstacks[c->nkstack++] = kstack;
+    kstack = 0;
+  }
+  popcli();
+  if(kstack)
+    kfree(kstack);
+}
+
 // Look in the process table for an UNUSED proc.
 // If found, change state to EMBRYO and initialize
 // state required to run in the kernel.
@@ -136,10 +169,14 @@ allocproc(void)
     // p->state = EMBRYO;
     // release(&ptable.lock);
   p->pid = allocpid();
+  p->insyscall = 0;
+  p->nswappin = 0;
+  p->swapheld = 0;
+  p->shmids = 0;
 
 
   // Allocate kernel stack.
-  if((p->kstack = kalloc()) == 0){
+  if((p->kstack = kstackalloc()) == 0){
     p->state = UNUSED;
     return 0;
   }
@@ -190,6 +227,7 @@ userinit(void)
   p->tf->esp = PGSIZE;
   p->tf->eip = 0;  // beginning of initcode.S
 
+  p->pgid = p->pid;
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
@@ -208,6 +246,34 @@ userinit(void)
   //release(&ptable.lock);
 }
 
+// Start a kernel thread called name running fn(), which must
+// never return. It has no user memory, never leaves the kernel
+// and ignores signals. Must be called after userinit().
+void
+kthread(char *name, void (*fn)(void))
+{
+  struct proc *p;
+  int sig;
+
+  if((p = allocproc()) == 0)
+    panic("kthread");
+  if((p->pgdir = setupkvm()) == 0)
+    panic("kthread: out of memory?");
+  p->sz = 0;
+  p->parent = initproc;
+  p->pgid = p->pid;
+  for(sig = 0; sig < NUM_OF_SIG_HANDLERS; sig++)
+    p->sig_handlers[sig] = (void*)SIG_IGN;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  // forkret() returns to fn instead of trapret.
+  *(uint*)((char*)p->context + sizeof(*p->context)) = (uint)fn;
+
+  pushcli();
+  p->state = RUNNABLE;
+  popcli();
+}
+
 // Grow current process's memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
@@ -218,6 +284,8 @@ growproc(int n)
 
   sz = curproc->sz;
   if(n > 0){
+    if(mmapoverlap(curproc, sz, sz + n))
+      return -1;
     if((sz = allocuvm(curproc->pgdir, sz, sz + n)) == 0)
       return -1;
   } else if(n < 0){
@@ -229,6 +297,33 @@ growproc(int n)
   return 0;
 }
 
+// Grow current process's memory by at least n bytes of large
+// pages, starting at the next 4 MB boundary; the gap below it
+// is filled with ordinary pages. Returns the start of the large
+// pages, or -1.
+int
+growhuge(int n)
+{
+  uint sz, base;
+  struct proc *curproc = myproc();
+
+  if(n <= 0)
+    return -1;
+  sz = curproc->sz;
+  base = HUGEPGROUNDUP(sz);
+  if(base >= KERNBASE || mmapoverlap(curproc, sz, HUGEPGROUNDUP(base + n)))
+    return -1;
+  if(allocuvm(curproc->pgdir, sz, base) == 0)
+    return -1;
+  if((sz = allochugeuvm(curproc->pgdir, base, base + n)) == 0){
+    deallocuvm(curproc->pgdir, base, curproc->sz);
+    return -1;
+  }
+  curproc->sz = sz;
+  switchuvm(curproc);
+  return base;
+}
+
 // Create a new process copying p as the parent.
 // Sets up stack to return as if from system call.
 // Caller must set state of returned proc to RUNNABLE.
@@ -246,13 +341,23 @@ fork(void)
 
   // Copy process state from proc.
   if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz)) == 0){
-    kfree(np->kstack);
+    kstackfree(np->kstack);
+    np->kstack = 0;
+    np->state = UNUSED;
+    return -1;
+  }
+  if(mmapfork(curproc, np) < 0){
+    mmapclear(np, np->pgdir);
+    freevm(np->pgdir);
+    np->pgdir = 0;
+    kstackfree(np->kstack);
     np->kstack = 0;
     np->state = UNUSED;
     return -1;
   }
   np->sz = curproc->sz;
   np->parent = curproc;
+  np->pgid = curproc->pgid;
   *np->tf = *curproc->tf;
 
   //COPY SIGNALS MASK AND HANDLERS
@@ -267,6 +372,7 @@ fork(void)
     if(curproc->ofile[i])
       np->ofile[i] = filedup(curproc->ofile[i]);
   np->cwd = idup(curproc->cwd);
+  shmfork(curproc, np);
 
   safestrcpy(np->name, curproc->name, sizeof(curproc->name));
 
@@ -294,6 +400,10 @@ exit(void)
   if(curproc == initproc)
     panic("init exiting");
 
+  // Unmap mmap() regions, writing back shared file pages.
+  mmapclear(curproc, curproc->pgdir);
+  shmexit(curproc);
+
   // Close all open files.
   for(fd = 0; fd < NOFILE; fd++){
     if(curproc->ofile[fd]){
@@ -302,7 +412,7 @@ exit(void)
     }
   }
 
-  begin_op();
+  begin_opn(IPUTBLOCKS);
   iput(curproc->cwd);
   end_op();
   curproc->cwd = 0;
@@ -357,6 +467,7 @@ wait(void)
         // Found one.
         pid = p->pid;
         p->pid = 0;
+        p->pgid = 0;
         p->parent = 0;
         p->name[0] = 0;
         curproc->chan = 0;
@@ -398,6 +509,7 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int ran;
   c->proc = 0;
   
   for(;;){
@@ -407,6 +519,7 @@ scheduler(void)
     // Loop over process table looking for process to run.
     // acquire(&ptable.lock);
     pushcli();
+    ran = 0;
     for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
       if(!cas(&p->state, RUNNABLE, RUNNING)) { // Find the first RUNNABLE proc and change its state to RUNNING
         continue;
@@ -417,10 +530,17 @@ scheduler(void)
         continue;
       }
 
+      // swapout() is taking its pages (swapclaim()).
+      if(p->swapheld){
+        cas(&p->state, RUNNING, RUNNABLE);
+        continue;
+      }
+
       // Switch to chosen process.  It is the process's job
       // to release ptable.lock and then reacquire it
       // before jumping back to us.
       c->proc = p;
+      ran = 1;
       switchuvm(p);
       // p->state = RUNNING;  // ORIGINALLY WAS HERE
 
@@ -441,7 +561,7 @@ scheduler(void)
       }
       if (p->state == NEG_ZOMBIE) {
         
-          kfree(p->kstack);
+          kstackfree(p->kstack);
           p->kstack = 0;
           freevm(p->pgdir);
           p->killed = 0;
@@ -452,10 +572,11 @@ scheduler(void)
     }
     // release(&ptable.lock);
     popcli();
-  }
-
-
 
+    // Nothing to run: clear a free page for kalloc_zeroed().
+    if(!ran)
+      kzero();
+  }
 }
 
 // Enter scheduler.  Must hold only ptable.lock
@@ -669,69 +790,152 @@ wakeup(void *chan)
   //release(&ptable.lock);
 }
 
+// Mark signum pending on p.
+// Must be called with interrupts disabled.
+static int
+sendsig(struct proc *p, int signum)
+{
+  /*
+  * if proc is sleeping so ignore SIGSTOP
+  */
+  if((signum == SIGSTOP && p->state == SLEEPING) ||
+    (signum == SIGSTOP && p->state == NEG_SLEEPING)){
+
+    return -1;
+  }
+
+  if(!isValidSig(signum))
+    return -1;
+
+  // Stamp the signal before it becomes pending: the target may be
+  // running on another cpu and deliver it at once.
+  p->sig_sent_tsc[signum] = rdtsc();
+  p->sig_sent_cpu[signum] = cpuid();
+  __sync_synchronize();
+  if(!setSignal(p, signum, 1))
+    return -1;
+
+  if(signum == SIGSTOP){
+    cas(&p->state, RUNNING, RUNNABLE);
+  }
+
+  // didnt add NEG_SLEEPING case because it's handled in schedular() after the context switch
+  return 0;
+}
+
 // Kill the process with the given pid.
+// A negative pid signals every process in process group -pid,
+// all in a single pass over the process table.
 // Process won't exit until it returns
 // to user space (see trap in trap.c).
 int
 kill(int pid, int signum)
 {
   struct proc *p;
+  int ret = -1;
 
-  //acquire(&ptable.lock);
   pushcli();
+  if(pid < 0){
+    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+      if(p->pid != 0 && p->pgid == -pid && sendsig(p, signum) == 0)
+        ret = 0;
+    }
+    popcli();
+    return ret;
+  }
+
   for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
     if(p->pid == pid){
+      ret = sendsig(p, signum);
+      popcli();
+      return ret;
+    }
+  }
+  popcli();
+  return -1;
+}
 
-      int ret = -1;
-
-      /*
-      * if proc is sleeping so ignore SIGSTOP
-      */
-      if((signum == SIGSTOP && p->state == SLEEPING) ||
-        (signum == SIGSTOP && p->state == NEG_SLEEPING)){
-
-        ret = -1;
-      }
-      else{
-
-
-        if(setSignal(p, signum, 1)){
-          if(signum == SIGSTOP){
-            cas(&p->state, RUNNING, RUNNABLE);
-          }
+// Set the process group of process pid (0 means the caller)
+// to pgid (0 means pgid = pid). Only the caller itself or
+// one of its children may be moved.
+int
+setpgid(int pid, int pgid)
+{
+  struct proc *p;
+  struct proc *curproc = myproc();
 
-          ret = 0;
-        }
-      }
+  if(pid < 0 || pgid < 0)
+    return -1;
+  if(pid == 0)
+    pid = curproc->pid;
+  if(pgid == 0)
+    pgid = pid;
 
-      /*
-      * should be moved to sigkill handler
-      */
-      //p->killed = 1;
+  pushcli();
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    if(p->pid == pid && (p == curproc || p->parent == curproc)){
+      p->pgid = pgid;
+      popcli();
+      return 0;
+    }
+  }
+  popcli();
+  return -1;
+}
 
+// Return the process group of process pid (0 means the caller).
+int
+getpgid(int pid)
+{
+  struct proc *p;
+  int pgid;
 
-      // Wake process from sleep if necessary.
-      //if(p->state == SLEEPING)
-        //p->state = RUNNABLE;
-      
-      // didnt add NEG_SLEEPING case because it's handled in schedular() after the context switch
-      
-      /*
-      * should be moved to sigkill handler
-      */
-      //cas(&p->state, SLEEPING, RUNNABLE);
-      
+  if(pid == 0)
+    return myproc()->pgid;
 
-      //release(&ptable.lock);
+  pushcli();
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    if(p->pid == pid){
+      pgid = p->pgid;
       popcli();
-      return ret;
+      return pgid;
     }
   }
-  //release(&ptable.lock);
   popcli();
   return -1;
 }
 
+// Claim process slot i for swapout() (swap.c), which may then
+// take pages from its page table. That is the caller itself, or a
+// runnable process that was preempted in user mode: p->swapheld
+// keeps it off the cpus until swaprelease(), and no kernel code is
+// in the middle of using its memory. Returns 0 if slot i is neither.
+struct proc*
+swapclaim(int i)
+{
+  struct proc *p = &ptable.proc[i];
+
+  if(p == myproc())
+    return p;
+  if(!cas(&p->swapheld, 0, 1))
+    return 0;
+  // The scheduler sets p->state and then looks at p->swapheld;
+  // this sets p->swapheld and then looks at p->state. Both use
+  // locked instructions, so one of them sees the other.
+  if(p->state != RUNNABLE || p->insyscall || p->pgdir == 0){
+    p->swapheld = 0;
+    return 0;
+  }
+  return p;
+}
+
+void
+swaprelease(struct proc *p)
+{
+  if(p != myproc() && !cas(&p->swapheld, 1, 0))
+    panic("swaprelease");
+}
+
 //PAGEBREAK: 36
 // Print a process listing to console.  For debugging.
 // Runs when user types ^P on console.
@@ -950,10 +1154,22 @@ void
 handlePendingSigs(/*???*/){
 
   struct proc *p = myproc();   // = process we handle..(how to know???)
+  uint picked;
+  int insyscall, nswappin, len;
   
   if(p == 0)
     return;
 
+  // A handler frame is built on the user stack below with
+  // interrupts off, so swap that in now and keep it in.
+  insyscall = p->insyscall;
+  nswappin = p->nswappin;
+  if(p->pending_sigs){
+    p->insyscall = 1;
+    len = (uint)&sigret_L_end - (uint)&sigret_L_start + 8;
+    swapinrange(p, p->tf->esp - len, len);
+  }
+
   pushcli();
   uint masks_backup = p->sig_masks; //backup masks
   
@@ -991,7 +1207,12 @@ handlePendingSigs(/*???*/){
           break;
 
       default:
+          picked = rdtsc();
           handleUserModeSigs(sig);
+          p->trace_sig = sig;
+          p->trace_picked = picked;
+          p->trace_delivered = rdtsc();
+          p->trace_cpu = cpuid();
     }
 
     p->sig_masks = masks_backup_iter; //restore masks
@@ -1000,6 +1221,8 @@ handlePendingSigs(/*???*/){
   p->sig_masks = masks_backup; //restore masks
 
   popcli();
+  p->insyscall = insyscall;
+  p->nswappin = nswappin;
 }
 
 int
@@ -1108,6 +1331,7 @@ initializeSignals(struct proc *p){
   
   p->pending_sigs = 0;
   p->sig_masks = 0;
+  p->trace_sig = -1;
 
   for(int sig=0; sig < NUM_OF_SIG_HANDLERS; sig++){
 
@@ -57,6 +57,10 @@ struct cpu {
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
   struct proc *proc;           // The process running on this cpu or null
+  char *kstacks[NSKEL];        // Free kernel stacks (see allocproc())
+  int nkstack;
+  pde_t *pgdirs[NSKEL];        // Free kernel-only page directories (see setupkvm())
+  int npgdir;
 };
 
 extern struct cpu cpus[NCPU];
@@ -81,6 +85,17 @@ struct context {
   uint eip;
 };
 
+// A region mapped with mmap(). Unused if end is 0.
+struct vma {
+  uint start;         // page aligned
+  uint end;           // page aligned, exclusive
+  int prot;           // PROT_* (mman.h)
+  int flags;          // MAP_* (mman.h)
+  struct file *f;     // backing file, or 0 for MAP_ANON
+  uint off;           // file offset of start
+  struct shm *shm;    // shared-memory segment (shm.c), or 0
+};
+
 enum procstate { UNUSED, NEG_UNUSED, EMBRYO, SLEEPING, NEG_SLEEPING, RUNNABLE, NEG_RUNNABLE, RUNNING, ZOMBIE, NEG_ZOMBIE };
 
 // Per-process state
@@ -90,6 +105,7 @@ struct proc {
   char *kstack;                // Bottom of kernel stack for this process
   enum procstate state;        // Process state
   int pid;                     // Process ID
+  int pgid;                    // Process group ID
   struct proc *parent;         // Parent process
   struct trapframe *tf;        // Trap frame for current syscall
   struct context *context;     // swtch() here to run process
@@ -98,6 +114,16 @@ struct proc {
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  struct vma vma[NVMA];        // mmap() regions, placed top-down below KERNBASE
+  uint shmids;                 // Segments open, one bit per shm.c slot
+  int insyscall;               // In a syscall or page fault: keep pages in (swap.c)
+  struct {
+    uint start, end;
+  } swappin[NSWAPPIN];         // Ranges the current syscall uses (swap.c)
+  int nswappin;
+  int swapheld;                // Claimed by swapout(): keep off the cpus
+  int logresv;                 // Log blocks reserved by the current FS op (log.c)
+  int logdresv;                // ... and file data blocks
 
   //FOR HANDLING SIGNALS
   uint pending_sigs;                  // 32bit array, stored as type uint
@@ -105,6 +131,14 @@ struct proc {
   // uint backup_sig_masks;                     // 32bit array, stored as type uint.
   void* sig_handlers[NUM_OF_SIG_HANDLERS];             // Array of size 32, of type void*.
   struct trapframe user_trap_backup; //Trapframe struct.
+
+  //FOR TRACING SIGNAL LATENCY (see sigtrace.h)
+  uint sig_sent_tsc[NUM_OF_SIG_HANDLERS];  // rdtsc when kill() marked each signal pending
+  int sig_sent_cpu[NUM_OF_SIG_HANDLERS];   // cpu kill() ran on, per signal
+  int trace_sig;                           // last signal redirected to a user handler
+  uint trace_picked;                       // rdtsc when handlePendingSigs() picked it up
+  uint trace_delivered;                    // rdtsc when the handler frame was built
+  int trace_cpu;                           // cpu it was delivered on
 };
 
 // Process memory is laid out contiguously, low addresses first:
@@ -169,7 +169,9 @@ main(void)
     }
     
     if(fork1() == 0){
-
+      // Each command line (a whole pipeline) gets its own process
+      // group, so it can be signalled at once with kill(-pgid, sig).
+      setpgid(0, 0);
       runcmd(parsecmd(buf));
     }
 
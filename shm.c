@@ -0,0 +1,314 @@
+// Named shared-memory segments and futexes.
+//
+// shm_open() finds or creates a segment by name and returns its id;
+// shm_attach() maps all of its pages into the calling process as a
+// shared mmap() region, so that every attached process sees the
+// same physical pages. The segment holds one reference on each page
+// and each mapping kref()s it once more. A segment lives while some
+// process has it open (from shm_open() until shm_close() or exit;
+// fork() passes it on) or some region is attached to it (until
+// shm_detach(), munmap(), exec or exit). An id names a slot and the
+// slot's generation, so the id of a freed segment does not name the
+// next segment created in that slot.
+//
+// futex_wait(addr, val) sleeps while *addr == val; futex_wake(addr)
+// wakes every process sleeping on addr. The sleep channel is the
+// kernel address of the word, so it is the same in every process
+// that maps the page, wherever it is mapped.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "mman.h"
+
+#define SHMNAME   16                   // longest name, with its nul
+#define SHMMAXPG  64                   // largest segment, in pages
+#define SHMMAXGEN (0x7fffffff / NSHM)  // generations before ids wrap
+
+struct shm {
+  char name[SHMNAME];     // empty if the slot is free
+  int ref;                // processes with it open, plus regions attached
+  uint gen;               // bumped each time the slot is reused
+  int npages;
+  char *pages[SHMMAXPG];
+};
+
+struct {
+  struct spinlock lock;
+  struct shm seg[NSHM];
+} shmtable;
+
+struct spinlock futexlock;
+
+#define SHMID(s)  ((s)->gen * NSHM + ((s) - shmtable.seg))
+
+void
+shminit(void)
+{
+  initlock(&shmtable.lock, "shm");
+  initlock(&futexlock, "futex");
+}
+
+static void
+shmfree(struct shm *s)
+{
+  int i;
+
+  for(i = 0; i < s->npages; i++)
+    kfree(s->pages[i]);
+  s->npages = 0;
+  s->name[0] = 0;
+}
+
+// The live segment with id id, or 0. Caller holds shmtable.lock.
+static struct shm*
+shmlookup(int id)
+{
+  struct shm *s;
+
+  if(id < 0)
+    return 0;
+  s = &shmtable.seg[id % NSHM];
+  if(s->name[0] == 0 || s->gen != id / NSHM)
+    return 0;
+  return s;
+}
+
+// Record that p has s open, taking a reference the first time.
+// Caller holds shmtable.lock.
+static void
+shmhold(struct proc *p, struct shm *s)
+{
+  int bit = 1 << (s - shmtable.seg);
+
+  if((p->shmids & bit) == 0){
+    p->shmids |= bit;
+    s->ref++;
+  }
+}
+
+// Drop a reference to s, freeing it after the last.
+// Caller holds shmtable.lock.
+static void
+shmrele(struct shm *s)
+{
+  if(--s->ref == 0)
+    shmfree(s);
+}
+
+// Find the segment called name, or create it with size bytes,
+// and keep it open for the current process. Returns its id, or -1.
+int
+shmopen(char *name, int size)
+{
+  struct shm *s, *free;
+  int n;
+
+  if(*name == 0 || strlen(name) >= SHMNAME)
+    return -1;
+
+  acquire(&shmtable.lock);
+  free = 0;
+  for(s = shmtable.seg; s < &shmtable.seg[NSHM]; s++){
+    if(s->name[0] == 0){
+      if(free == 0)
+        free = s;
+    } else if(strncmp(s->name, name, SHMNAME) == 0){
+      n = -1;
+      if(size <= s->npages*PGSIZE){
+        shmhold(myproc(), s);
+        n = SHMID(s);
+      }
+      release(&shmtable.lock);
+      return n;
+    }
+  }
+
+  n = PGROUNDUP(size) / PGSIZE;
+  if(free == 0 || size <= 0 || n > SHMMAXPG){
+    release(&shmtable.lock);
+    return -1;
+  }
+  s = free;
+  safestrcpy(s->name, name, SHMNAME);
+  s->ref = 0;
+  s->gen = (s->gen + 1) % SHMMAXGEN;
+  for(s->npages = 0; s->npages < n; s->npages++){
+    if((s->pages[s->npages] = kalloc_zeroed()) == 0){
+      shmfree(s);
+      release(&shmtable.lock);
+      return -1;
+    }
+  }
+  shmhold(myproc(), s);
+  n = SHMID(s);
+  release(&shmtable.lock);
+  return n;
+}
+
+// The current process no longer needs segment id open.
+// Returns 0, or -1 if it did not have it open.
+int
+shmclose(int id)
+{
+  struct proc *p = myproc();
+  struct shm *s;
+  int bit;
+
+  acquire(&shmtable.lock);
+  s = shmlookup(id);
+  bit = s ? 1 << (s - shmtable.seg) : 0;
+  if((p->shmids & bit) == 0){
+    release(&shmtable.lock);
+    return -1;
+  }
+  p->shmids &= ~bit;
+  shmrele(s);
+  release(&shmtable.lock);
+  return 0;
+}
+
+// Give child np the segments p has open.
+void
+shmfork(struct proc *p, struct proc *np)
+{
+  int i;
+
+  acquire(&shmtable.lock);
+  for(i = 0; i < NSHM; i++)
+    if(p->shmids & (1 << i))
+      shmhold(np, &shmtable.seg[i]);
+  release(&shmtable.lock);
+}
+
+// Close the segments p has open, as it exits.
+void
+shmexit(struct proc *p)
+{
+  int i;
+
+  acquire(&shmtable.lock);
+  for(i = 0; i < NSHM; i++)
+    if(p->shmids & (1 << i))
+      shmrele(&shmtable.seg[i]);
+  p->shmids = 0;
+  release(&shmtable.lock);
+}
+
+// Map segment id into the current process.
+// Returns the address of the mapping, or -1.
+int
+shmattach(int id)
+{
+  struct proc *p = myproc();
+  struct shm *s;
+  struct vma *v;
+  int i;
+
+  acquire(&shmtable.lock);
+  if((s = shmlookup(id)) == 0 || (v = vmaalloc(p, s->npages*PGSIZE)) == 0){
+    release(&shmtable.lock);
+    return -1;
+  }
+  s->ref++;
+  release(&shmtable.lock);
+
+  v->prot = PROT_READ|PROT_WRITE;
+  v->flags = MAP_SHARED;
+  v->shm = s;
+  for(i = 0; i < s->npages; i++){
+    if(mappages(p->pgdir, (char*)v->start + i*PGSIZE, PGSIZE,
+                V2P(s->pages[i]), PTE_W|PTE_U) < 0){
+      munmap(v->start, v->end - v->start);
+      return -1;
+    }
+    kref(s->pages[i]);
+  }
+  return v->start;
+}
+
+// Unmap the segment mapped at addr.
+int
+shmdetach(uint addr)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end && v->shm && v->start == addr)
+      return munmap(v->start, v->end - v->start);
+  return -1;
+}
+
+// Another region refers to s (fork, split by munmap).
+void
+shmdup(struct shm *s)
+{
+  acquire(&shmtable.lock);
+  s->ref++;
+  release(&shmtable.lock);
+}
+
+// A region referring to s is gone; free s after the last.
+void
+shmput(struct shm *s)
+{
+  acquire(&shmtable.lock);
+  shmrele(s);
+  release(&shmtable.lock);
+}
+
+// Kernel address of the user word at addr, or 0 if not mapped.
+static int*
+futexkey(uint addr)
+{
+  struct proc *p = myproc();
+  char *page;
+
+  if(addr % sizeof(int) || addr >= KERNBASE)
+    return 0;
+  if(addr >= p->sz && mmapprefault(p, addr, sizeof(int), 0) < 0)
+    return 0;
+  if(addr < p->sz && swapinrange(p, addr, sizeof(int)) < 0)
+    return 0;
+  if((page = uva2ka(p->pgdir, (char*)PGROUNDDOWN(addr))) == 0)
+    return 0;
+  return (int*)(page + addr % PGSIZE);
+}
+
+// Sleep until woken if the word at addr holds val.
+// Returns 0 after sleeping, -1 if *addr != val.
+int
+futexwait(uint addr, int val)
+{
+  int *key;
+
+  if((key = futexkey(addr)) == 0)
+    return -1;
+  acquire(&futexlock);
+  if(*key != val){
+    release(&futexlock);
+    return -1;
+  }
+  sleep(key, &futexlock);
+  release(&futexlock);
+  return 0;
+}
+
+// Wake the processes sleeping in futexwait() on addr.
+int
+futexwake(uint addr)
+{
+  int *key;
+
+  if((key = futexkey(addr)) == 0)
+    return -1;
+  acquire(&futexlock);
+  wakeup(key);
+  release(&futexlock);
+  return 0;
+}
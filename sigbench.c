@@ -0,0 +1,134 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "x86.h"
+#include "sigtrace.h"
+
+#define SIGKILL 9
+#define SIGPING 10
+#define SIGPONG 12
+
+#define ROUNDS 100
+
+/*
+* Signal delivery latency benchmark.
+*
+* The parent sends SIGPING to a spinning child, whose handler answers
+* with SIGPONG. The parent measures the round trip with rdtsc and uses
+* sigtrace() to split the SIGPONG leg into its kernel stages:
+*   kill()                -> handlePendingSigs()   (waiting to be noticed)
+*   handlePendingSigs()   -> handler frame built   (delivery work)
+*   handler frame built   -> handler entry         (return to user space)
+* Samples are grouped by whether kill() and the delivery ran on the
+* same cpu or on different cpus. Run with CPUS=1 to force same-core.
+*/
+
+struct sample {
+    uint rtt;
+    uint waiting;
+    uint delivery;
+    uint entry;
+};
+
+int peer;
+volatile int pongs;
+volatile uint pong_tsc;
+struct sigtrace pong_trace;
+
+struct sample samecpu[ROUNDS];
+struct sample crosscpu[ROUNDS];
+
+void
+pingHandler(int signum){
+    kill(peer, SIGPONG);
+}
+
+void
+pongHandler(int signum){
+    pong_tsc = rdtsc();
+    sigtrace(&pong_trace);
+    pongs++;
+}
+
+uint
+median(struct sample *s, int n, int field){
+    uint v[ROUNDS];
+    uint t;
+    int i, j;
+
+    for(i = 0; i < n; i++){
+        switch(field){
+            case 0: v[i] = s[i].rtt; break;
+            case 1: v[i] = s[i].waiting; break;
+            case 2: v[i] = s[i].delivery; break;
+            default: v[i] = s[i].entry;
+        }
+    }
+    for(i = 1; i < n; i++){
+        t = v[i];
+        for(j = i; j > 0 && v[j-1] > t; j--)
+            v[j] = v[j-1];
+        v[j] = t;
+    }
+    return v[n/2];
+}
+
+void
+report(char *name, struct sample *s, int n){
+    if(n == 0){
+        printf(1, "%s: no samples\n", name);
+        return;
+    }
+    printf(1, "%s: %d rounds, median cycles: round trip %d, "
+              "kill->pickup %d, pickup->frame %d, frame->handler %d\n",
+           name, n, median(s, n, 0), median(s, n, 1),
+           median(s, n, 2), median(s, n, 3));
+}
+
+int
+main(void){
+    struct sample *s;
+    int child, i, n, nsame, ncross;
+    uint start;
+
+    signal(SIGPING, pingHandler);
+    signal(SIGPONG, pongHandler);
+
+    peer = getpid();
+    child = fork();
+    if(child < 0){
+        printf(2, "sigbench: fork failed\n");
+        exit();
+    }
+    if(child == 0){
+        // Every syscall return runs handlePendingSigs(), so spin on one.
+        for(;;)
+            getpid();
+    }
+    peer = child;
+
+    nsame = ncross = 0;
+    for(i = 0; i < ROUNDS; i++){
+        n = pongs;
+        start = rdtsc();
+        kill(child, SIGPING);
+        while(pongs == n)
+            getpid();
+
+        if(pong_trace.sendcpu == pong_trace.delivercpu)
+            s = &samecpu[nsame++];
+        else
+            s = &crosscpu[ncross++];
+        s->rtt = pong_tsc - start;
+        s->waiting = pong_trace.picked - pong_trace.sent;
+        s->delivery = pong_trace.delivered - pong_trace.picked;
+        s->entry = pong_tsc - pong_trace.delivered;
+    }
+
+    kill(child, SIGKILL);
+    wait();
+
+    report("same cpu", samecpu, nsame);
+    report("cross cpu", crosscpu, ncross);
+    exit();
+}
@@ -0,0 +1,12 @@
+// Timestamps (low 32 bits of rdtsc) of the stages a signal went
+// through on its way to a user handler. Filled in by the kernel
+// and read back with sigtrace().
+// Both the kernel and user programs use this header file.
+struct sigtrace {
+  int signum;       // signal that was delivered, -1 if none yet
+  uint sent;        // kill() marked the signal pending
+  uint picked;      // handlePendingSigs() picked it up
+  uint delivered;   // trapframe redirected to the user handler
+  int sendcpu;      // cpu kill() ran on
+  int delivercpu;   // cpu the handler was delivered on
+};
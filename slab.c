@@ -0,0 +1,257 @@
+// Slab allocator for small kernel objects.
+//
+// kmalloc(n) returns n bytes (n <= KMMAX) from a power-of-two size
+// class. Each class carves kalloc() pages ("slabs") into equal
+// objects; the slab header sits at the start of the page, so
+// kmfree() finds it by rounding the pointer down. Each cpu keeps a
+// small stack of free objects per class so that most calls touch
+// no lock at all; the stack is refilled from, and flushed back to,
+// the class's slabs in batches. A slab whose objects are all free
+// goes back to kalloc() unless it is the class's only empty one.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+
+#define KMMIN     16            // smallest class
+#define NKMCLASS  8             // 16, 32, ..., 2048
+#define KMCACHE   16            // objects per cpu cache
+#define KMBATCH   (KMCACHE/2)   // objects moved per refill/flush
+
+struct kmobj {
+  struct kmobj *next;
+};
+
+// Header at the start of every slab page.
+struct slab {
+  struct slab *next;      // on the class's partial list
+  struct slab *prev;
+  int class;
+  int inuse;              // objects handed out (incl. cpu caches)
+  int nobj;
+  struct kmobj *free;
+};
+
+// Objects start here; 16-byte aligned whatever the class.
+#define SLABHDR   ((sizeof(struct slab) + KMMIN-1) & ~(KMMIN-1))
+
+struct kmclass {
+  struct spinlock lock;
+  uint size;
+  struct slab partial;    // slabs with at least one free object
+  int nslabs;
+  int nempty;             // partial slabs with inuse == 0
+};
+
+struct kmcpu {
+  void *obj[NKMCLASS][KMCACHE];
+  int n[NKMCLASS];
+};
+
+struct {
+  struct kmclass class[NKMCLASS];
+  struct kmcpu cpu[NCPU];
+} kmem_slab;
+
+void
+slabinit(void)
+{
+  struct kmclass *kc;
+  int i;
+
+  for(i = 0; i < NKMCLASS; i++){
+    kc = &kmem_slab.class[i];
+    initlock(&kc->lock, "slab");
+    kc->size = KMMIN << i;
+    kc->partial.next = kc->partial.prev = &kc->partial;
+  }
+}
+
+static int
+sizeclass(uint n)
+{
+  int i;
+
+  for(i = 0; i < NKMCLASS; i++)
+    if(n <= (KMMIN << i))
+      return i;
+  return -1;
+}
+
+static void
+slabunlink(struct slab *s)
+{
+  s->prev->next = s->next;
+  s->next->prev = s->prev;
+  s->next = s->prev = 0;
+}
+
+static void
+slablink(struct kmclass *kc, struct slab *s)
+{
+  s->next = kc->partial.next;
+  s->prev = &kc->partial;
+  kc->partial.next->prev = s;
+  kc->partial.next = s;
+}
+
+// Make a fresh slab for class i. Called without kc->lock.
+static struct slab*
+slabnew(int i)
+{
+  struct slab *s;
+  struct kmobj *o;
+  char *p;
+  uint size = KMMIN << i;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->class = i;
+  s->inuse = 0;
+  s->nobj = 0;
+  s->free = 0;
+  for(p = (char*)s + SLABHDR; p + size <= (char*)s + PGSIZE; p += size){
+    o = (struct kmobj*)p;
+    o->next = s->free;
+    s->free = o;
+    s->nobj++;
+  }
+  return s;
+}
+
+// Move up to n objects of class i from its slabs into out[].
+// Returns how many were moved.
+static int
+slabget(int i, void **out, int n)
+{
+  struct kmclass *kc = &kmem_slab.class[i];
+  struct slab *s;
+  int got = 0;
+
+  acquire(&kc->lock);
+  while(got < n){
+    s = kc->partial.next;
+    if(s == &kc->partial){
+      release(&kc->lock);
+      if((s = slabnew(i)) == 0)
+        return got;
+      acquire(&kc->lock);
+      slablink(kc, s);
+      kc->nslabs++;
+      kc->nempty++;
+    }
+    if(s->inuse == 0)
+      kc->nempty--;
+    while(got < n && s->free){
+      out[got++] = s->free;
+      s->free = s->free->next;
+      s->inuse++;
+    }
+    if(s->free == 0)
+      slabunlink(s);
+  }
+  release(&kc->lock);
+  return got;
+}
+
+// Return n objects of class i to their slabs.
+static void
+slabput(int i, void **in, int n)
+{
+  struct kmclass *kc = &kmem_slab.class[i];
+  struct slab *s, *dead;
+  struct kmobj *o;
+
+  dead = 0;
+  acquire(&kc->lock);
+  while(n-- > 0){
+    o = (struct kmobj*)in[n];
+    s = (struct slab*)PGROUNDDOWN((uint)o);
+    if(s->free == 0)
+      slablink(kc, s);
+    o->next = s->free;
+    s->free = o;
+    if(--s->inuse == 0){
+      if(kc->nempty > 0){
+        // Keep one empty slab around; free the rest.
+        slabunlink(s);
+        kc->nslabs--;
+        s->next = dead;
+        dead = s;
+      } else
+        kc->nempty++;
+    }
+  }
+  release(&kc->lock);
+
+  while(dead){
+    s = dead;
+    dead = s->next;
+    kfree((char*)s);
+  }
+}
+
+// Allocate n bytes. Returns 0 if n is too large or
+// memory is exhausted. The memory is not zeroed.
+void*
+kmalloc(uint n)
+{
+  struct kmcpu *c;
+  void *v;
+  int i;
+
+  if((i = sizeclass(n)) < 0)
+    return 0;
+
+  pushcli();
+  c = &kmem_slab.cpu[cpuid()];
+  if(c->n[i] == 0)
+    c->n[i] = slabget(i, c->obj[i], KMBATCH);
+  v = c->n[i] > 0 ? c->obj[i][--c->n[i]] : 0;
+  popcli();
+  return v;
+}
+
+// Free memory returned by kmalloc().
+void
+kmfree(void *v)
+{
+  struct kmcpu *c;
+  struct slab *s;
+  int i;
+
+  s = (struct slab*)PGROUNDDOWN((uint)v);
+  i = s->class;
+  if(i < 0 || i >= NKMCLASS || (char*)v < (char*)s + SLABHDR)
+    panic("kmfree");
+
+  pushcli();
+  c = &kmem_slab.cpu[cpuid()];
+  if(c->n[i] == KMCACHE){
+    c->n[i] -= KMBATCH;
+    slabput(i, &c->obj[i][c->n[i]], KMBATCH);
+  }
+  c->obj[i][c->n[i]++] = v;
+  popcli();
+}
+
+// Print per-class slab usage.
+// Runs when user types ^P on console. No lock, as for procdump().
+void
+slabdump(void)
+{
+  struct kmclass *kc;
+  int i;
+
+  cprintf("slab:");
+  for(i = 0; i < NKMCLASS; i++){
+    kc = &kmem_slab.class[i];
+    if(kc->nslabs)
+      cprintf(" %d:%d", kc->size, kc->nslabs);
+  }
+  cprintf(" (size:slabs)\n");
+}
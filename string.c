@@ -1,14 +1,29 @@
 #include "types.h"
 #include "x86.h"
 
+// The string and memory primitives below work a dword at a time
+// with rep stosl/movsl wherever the addresses allow it. The kernel
+// is built with -O0, so a plain C loop here costs several
+// instructions per byte.
+
 void*
 memset(void *dst, int c, uint n)
 {
-  if ((int)dst%4 == 0 && n%4 == 0){
-    c &= 0xFF;
-    stosl(dst, (c<<24)|(c<<16)|(c<<8)|c, n/4);
-  } else
-    stosb(dst, c, n);
+  char *d;
+  uint k;
+
+  d = dst;
+  c &= 0xFF;
+  if(n >= 16){
+    k = (4 - (uint)d%4) % 4;
+    stosb(d, c, k);
+    d += k;
+    n -= k;
+    stosl(d, (c<<24)|(c<<16)|(c<<8)|c, n/4);
+    d += n & ~3;
+    n %= 4;
+  }
+  stosb(d, c, n);
   return dst;
 }
 
@@ -19,6 +34,10 @@ memcmp(const void *v1, const void *v2, uint n)
 
   s1 = v1;
   s2 = v2;
+  while(n >= 4 && *(uint*)s1 == *(uint*)s2){
+    s1 += 4, s2 += 4;
+    n -= 4;
+  }
   while(n-- > 0){
     if(*s1 != *s2)
       return *s1 - *s2;
@@ -33,17 +52,34 @@ memmove(void *dst, const void *src, uint n)
 {
   const char *s;
   char *d;
+  uint k;
 
   s = src;
   d = dst;
   if(s < d && s + n > d){
+    // Overlapping, with dst above src: copy from the end down.
     s += n;
     d += n;
-    while(n-- > 0)
-      *--d = *--s;
-  } else
-    while(n-- > 0)
-      *d++ = *s++;
+    if(n >= 16 && (uint)s%4 == (uint)d%4){
+      k = (uint)d%4;
+      movsbrev(d-1, s-1, k);
+      s -= k, d -= k, n -= k;
+      movslrev(d-4, s-4, n/4);
+      s -= n & ~3, d -= n & ~3;
+      n %= 4;
+    }
+    movsbrev(d-1, s-1, n);
+  } else {
+    if(n >= 16 && (uint)s%4 == (uint)d%4){
+      k = (4 - (uint)d%4) % 4;
+      movsb(d, s, k);
+      s += k, d += k, n -= k;
+      movsl(d, s, n/4);
+      s += n & ~3, d += n & ~3;
+      n %= 4;
+    }
+    movsb(d, s, n);
+  }
 
   return dst;
 }
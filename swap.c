@@ -0,0 +1,283 @@
+// Demand paging to a swap area.
+//
+// When kalloc() runs dry, swapalloc() first has the buffer and inode
+// caches give memory back (bshrink(), ishrink()) and then evicts user
+// pages to the swap area until a page is free. The victim is picked
+// by a clock sweep over every process's pages below p->sz: a page
+// whose PTE_A bit is set has that bit cleared and is passed over
+// ("referenced"); the first page found without it is written out.
+// Its PTE loses PTE_P and gets PTE_SWAPPED, with the swap slot in
+// the address bits and the permission bits kept, so that swapin()
+// can map it back when the process faults on it or a system call is
+// about to use it.
+//
+// Only the running process (the one short of memory) and runnable
+// processes preempted in user mode (swapclaim() in proc.c) give up
+// pages, and the running process keeps the ranges its system call
+// has brought in with swapinrange(), so no kernel code can be in the
+// middle of using a page that goes. A page just swapped in starts
+// out referenced. Mmap() regions and large pages are never swapped.
+//
+// The swap area is a range of blocks on the boot disk past the
+// kernel (SWAPDEV, SWAPSTART, NSWAPPG in param.h); pages go to and
+// from it through iderw() without passing through the buffer cache.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "x86.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+
+#define BPP (PGSIZE/BSIZE)    // blocks per page
+
+struct {
+  struct sleeplock lock;      // one swapout() at a time; guards the hand
+  int hand;                   // clock hand: process slot ...
+  uint handva;                // ... and address in it
+  struct spinlock slotlock;
+  uchar used[NSWAPPG];        // slot holds a page
+  int nused;
+  int next;                   // where to look for a free slot
+  struct buf buf;             // for swaprw(), under its sleeplock
+  uint outs;                  // pages written out
+  uint ins;                   // pages read back on a fault or syscall
+  uint refs;                  // pages passed over because PTE_A was set
+  uint fails;                 // swapout() found nothing to evict
+} swap;
+
+void
+swapinit(void)
+{
+  initsleeplock(&swap.lock, "swap");
+  initlock(&swap.slotlock, "swapslot");
+  initsleeplock(&swap.buf.lock, "swapbuf");
+}
+
+static int
+slotalloc(void)
+{
+  int i, s;
+
+  acquire(&swap.slotlock);
+  for(i = 0; i < NSWAPPG; i++){
+    s = (swap.next + i) % NSWAPPG;
+    if(!swap.used[s]){
+      swap.used[s] = 1;
+      swap.nused++;
+      swap.next = s + 1;
+      release(&swap.slotlock);
+      return s;
+    }
+  }
+  release(&swap.slotlock);
+  return -1;
+}
+
+static void
+slotfree(int s)
+{
+  acquire(&swap.slotlock);
+  if(!swap.used[s])
+    panic("slotfree");
+  swap.used[s] = 0;
+  swap.nused--;
+  release(&swap.slotlock);
+}
+
+// Copy page mem to or from swap slot s. The buffer's data
+// points straight into the page.
+static void
+swaprw(int s, char *mem, int write)
+{
+  struct buf *b = &swap.buf;
+  int i;
+
+  acquiresleep(&b->lock);
+  b->dev = SWAPDEV;
+  for(i = 0; i < BPP; i++){
+    b->blockno = SWAPSTART + s*BPP + i;
+    b->data = (uchar*)mem + i*BSIZE;
+    b->flags = write ? B_DIRTY : 0;
+    iderw(b);
+  }
+  releasesleep(&b->lock);
+}
+
+// Keep [start, end) of p, the calling process, in memory until
+// its system call returns: swapout() passes over those pages, so
+// that bringing in one page of a buffer cannot evict another.
+static void
+swappin(struct proc *p, uint start, uint end)
+{
+  int i;
+
+  start = PGROUNDDOWN(start);
+  if(p->nswappin < NSWAPPIN){
+    i = p->nswappin++;
+    p->swappin[i].start = start;
+    p->swappin[i].end = end;
+    return;
+  }
+  // Out of slots: widen the last range to cover this one too.
+  i = NSWAPPIN - 1;
+  if(start < p->swappin[i].start)
+    p->swappin[i].start = start;
+  if(end > p->swappin[i].end)
+    p->swappin[i].end = end;
+}
+
+static int
+swappinned(struct proc *p, uint va)
+{
+  int i;
+
+  for(i = 0; i < p->nswappin; i++)
+    if(va >= p->swappin[i].start && va < p->swappin[i].end)
+      return 1;
+  return 0;
+}
+
+// Evict one user page. Returns 0 if a page was freed, -1 if
+// there was nothing to evict or no room in the swap area.
+static int
+swapout(void)
+{
+  struct proc *p, *me = myproc();
+  pte_t *pte;
+  char *mem;
+  uint va;
+  int s, n, refs, nrefs;
+
+  if((s = slotalloc()) < 0)
+    return -1;
+
+  acquiresleep(&swap.lock);
+  // Two sweeps over every process: the first may only clear PTE_A.
+  for(n = 0; n <= 2*NPROC; n++){
+    if((p = swapclaim(swap.hand)) != 0){
+      va = swap.handva;
+      pte = uvmclock(p->pgdir, &va, p->sz, &refs);
+      // Not the pages our own system call is using.
+      while(pte && p == me && swappinned(p, va)){
+        va += PGSIZE;
+        pte = uvmclock(p->pgdir, &va, p->sz, &nrefs);
+        refs += nrefs;
+      }
+      swap.refs += refs;
+      if(pte){
+        mem = P2V(PTE_ADDR(*pte));
+        *pte = (s << PGSHIFT) | (PTE_FLAGS(*pte) & (PTE_W|PTE_U)) | PTE_SWAPPED;
+        if(p == me)
+          lcr3(V2P(p->pgdir));
+        swaprw(s, mem, 1);
+        swaprelease(p);
+        swap.handva = va + PGSIZE;
+        swap.outs++;
+        releasesleep(&swap.lock);
+        kfree(mem);
+        return 0;
+      }
+      if(p == me && refs)
+        lcr3(V2P(p->pgdir));
+      swaprelease(p);
+    }
+    swap.hand = (swap.hand + 1) % NPROC;
+    swap.handva = 0;
+  }
+  swap.fails++;
+  releasesleep(&swap.lock);
+  slotfree(s);
+  return -1;
+}
+
+// Allocate a page for user memory, zeroed if zero is set. If
+// memory has run out, shrink the buffer cache and then swap
+// other pages out. The caller must be able to sleep. Returns 0
+// if no page can be had.
+char*
+swapalloc(int zero)
+{
+  char *mem;
+
+  for(;;){
+    mem = zero ? kalloc_zeroed() : kalloc();
+    if(mem || (bshrink() == 0 && ishrink() == 0 && swapout() < 0))
+      return mem;
+  }
+}
+
+// Map page va of p back in if it is swapped out.
+// Returns 0 if it was and now is mapped, else -1.
+int
+swapin(struct proc *p, uint va)
+{
+  pte_t *pte;
+  char *mem;
+  int s;
+
+  if(va >= p->sz || (p->pgdir[PDX(va)] & PTE_PS))
+    return -1;
+  if((pte = walkpgdir(p->pgdir, (char*)va, 0)) == 0 || !(*pte & PTE_SWAPPED))
+    return -1;
+  if((mem = swapalloc(0)) == 0)
+    return -1;
+  s = PTE_ADDR(*pte) >> PGSHIFT;
+  swaprw(s, mem, 0);
+  // PTE_A, so that the clock's next pass does not take it straight back.
+  *pte = V2P(mem) | (PTE_FLAGS(*pte) & ~PTE_SWAPPED) | PTE_P | PTE_A;
+  slotfree(s);
+  swap.ins++;
+  return 0;
+}
+
+// Swap in the pages of [addr, addr+len) in p that are out,
+// so that the kernel can use them without faulting, and keep
+// them in until the system call returns.
+// Returns -1 if one could not be brought in.
+int
+swapinrange(struct proc *p, uint addr, uint len)
+{
+  pte_t *pte;
+  uint va;
+
+  if(p == myproc())
+    swappin(p, addr, addr + len);
+  for(va = PGROUNDDOWN(addr); va < addr + len && va < p->sz; va += PGSIZE){
+    if(p->pgdir[PDX(va)] & PTE_PS)
+      continue;
+    pte = walkpgdir(p->pgdir, (char*)va, 0);
+    if(pte && (*pte & PTE_SWAPPED) && swapin(p, va) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Copy the contents of the swapped-out page described by
+// pte into mem (copyuvm()).
+void
+swapcopy(pte_t pte, char *mem)
+{
+  swaprw(PTE_ADDR(pte) >> PGSHIFT, mem, 0);
+}
+
+// The swapped-out page described by pte is no longer needed.
+void
+swapdrop(pte_t pte)
+{
+  slotfree(PTE_ADDR(pte) >> PGSHIFT);
+}
+
+// Print swap usage and clock statistics.
+// Runs when user types ^P on console. No lock, as for procdump().
+void
+swapdump(void)
+{
+  cprintf("swap: %d/%d pages used, %d out, %d in, %d referenced, %d failed\n",
+          swap.nused, NSWAPPG, swap.outs, swap.ins, swap.refs, swap.fails);
+}
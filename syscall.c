@@ -53,22 +53,46 @@ argint(int n, int *ip)
 }
 
 // Fetch the nth word-sized system call argument as a pointer
-// to a block of memory of size bytes.  Check that the pointer
-// lies within the process address space.
-int
-argptr(int n, char **pp, int size)
+// to a block of memory of size bytes that the kernel will write
+// to if write is set.  Check that the pointer lies within the
+// process address space: below sz, or in an mmap() region. Pages
+// that are swapped out or, in a region, not yet filled in are
+// brought in now, so that the kernel never faults on them (it may
+// use them with a spinlock held, as pipes and the console do).
+static int
+argbuf(int n, char **pp, int size, int write)
 {
   int i;
   struct proc *curproc = myproc();
  
   if(argint(n, &i) < 0)
     return -1;
-  if(size < 0 || (uint)i >= curproc->sz || (uint)i+size > curproc->sz)
+  if(size < 0)
+    return -1;
+  if((uint)i >= curproc->sz || (uint)i+size > curproc->sz){
+    if(mmapprefault(curproc, i, size, write) < 0)
+      return -1;
+  } else if(swapinrange(curproc, i, size) < 0)
     return -1;
   *pp = (char*)i;
   return 0;
 }
 
+// Fetch the nth word-sized system call argument as a pointer
+// to a block of memory of size bytes that the kernel reads.
+int
+argptr(int n, char **pp, int size)
+{
+  return argbuf(n, pp, size, 0);
+}
+
+// Like argptr(), for a block the kernel writes to.
+int
+argptrw(int n, char **pp, int size)
+{
+  return argbuf(n, pp, size, 1);
+}
+
 // Fetch the nth word-sized system call argument as a string pointer.
 // Check that the pointer is valid and the string is nul-terminated.
 // (There is no shared writable memory, so the string can't change
@@ -106,6 +130,19 @@ extern int sys_uptime(void);
 extern int sys_sigprocmask(void);
 extern int sys_signal(void);
 extern int sys_sigret(void);
+extern int sys_sigtrace(void);
+extern int sys_setpgid(void);
+extern int sys_getpgid(void);
+extern int sys_sbrkhuge(void);
+extern int sys_mmap(void);
+extern int sys_munmap(void);
+extern int sys_shm_open(void);
+extern int sys_shm_attach(void);
+extern int sys_shm_detach(void);
+extern int sys_futex_wait(void);
+extern int sys_futex_wake(void);
+extern int sys_fsync(void);
+extern int sys_shm_close(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -132,6 +169,19 @@ static int (*syscalls[])(void) = {
 [SYS_sigprocmask]   sys_sigprocmask,
 [SYS_signal]   sys_signal,
 [SYS_sigret]   sys_sigret,
+[SYS_sigtrace]   sys_sigtrace,
+[SYS_setpgid]   sys_setpgid,
+[SYS_getpgid]   sys_getpgid,
+[SYS_sbrkhuge]  sys_sbrkhuge,
+[SYS_mmap]      sys_mmap,
+[SYS_munmap]    sys_munmap,
+[SYS_shm_open]   sys_shm_open,
+[SYS_shm_attach] sys_shm_attach,
+[SYS_shm_detach] sys_shm_detach,
+[SYS_futex_wait] sys_futex_wait,
+[SYS_futex_wake] sys_futex_wake,
+[SYS_fsync]     sys_fsync,
+[SYS_shm_close] sys_shm_close,
 };
 
 void
@@ -23,3 +23,16 @@
 #define SYS_sigprocmask  22
 #define SYS_signal  23
 #define SYS_sigret  24
+#define SYS_sigtrace  25
+#define SYS_setpgid  26
+#define SYS_getpgid  27
+#define SYS_sbrkhuge 28
+#define SYS_mmap     29
+#define SYS_munmap   30
+#define SYS_shm_open   31
+#define SYS_shm_attach 32
+#define SYS_shm_detach 33
+#define SYS_futex_wait 34
+#define SYS_futex_wake 35
+#define SYS_fsync  36
+#define SYS_shm_close  37
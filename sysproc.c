@@ -6,6 +6,7 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
+#include "sigtrace.h"
 
 
 int
@@ -41,6 +42,26 @@ sys_kill(void)
   return kill(pid, signum);
 }
 
+int
+sys_setpgid(void)
+{
+  int pid, pgid;
+
+  if(argint(0, &pid) < 0 || argint(1, &pgid) < 0)
+    return -1;
+  return setpgid(pid, pgid);
+}
+
+int
+sys_getpgid(void)
+{
+  int pid;
+
+  if(argint(0, &pid) < 0)
+    return -1;
+  return getpgid(pid);
+}
+
 int
 sys_getpid(void)
 {
@@ -61,6 +82,79 @@ sys_sbrk(void)
   return addr;
 }
 
+// Like sbrk(), but the new memory is 4 MB aligned and
+// backed by large pages.
+int
+sys_sbrkhuge(void)
+{
+  int n;
+
+  if(argint(0, &n) < 0)
+    return -1;
+  return growhuge(n);
+}
+
+int
+sys_shm_open(void)
+{
+  char *name;
+  int size;
+
+  if(argstr(0, &name) < 0 || argint(1, &size) < 0)
+    return -1;
+  return shmopen(name, size);
+}
+
+int
+sys_shm_attach(void)
+{
+  int id;
+
+  if(argint(0, &id) < 0)
+    return -1;
+  return shmattach(id);
+}
+
+int
+sys_shm_detach(void)
+{
+  int addr;
+
+  if(argint(0, &addr) < 0)
+    return -1;
+  return shmdetach(addr);
+}
+
+int
+sys_shm_close(void)
+{
+  int id;
+
+  if(argint(0, &id) < 0)
+    return -1;
+  return shmclose(id);
+}
+
+int
+sys_futex_wait(void)
+{
+  int addr, val;
+
+  if(argint(0, &addr) < 0 || argint(1, &val) < 0)
+    return -1;
+  return futexwait(addr, val);
+}
+
+int
+sys_futex_wake(void)
+{
+  int addr;
+
+  if(argint(0, &addr) < 0)
+    return -1;
+  return futexwake(addr);
+}
+
 int
 sys_sleep(void)
 {
@@ -125,3 +219,25 @@ sys_sigret(void){
   sigret();
   return 1;
 }
+
+// Copy the kernel timestamps of the last signal delivered
+// to one of this process's handlers into a struct sigtrace.
+int
+sys_sigtrace(void){
+
+  struct sigtrace *st;
+  struct proc *p = myproc();
+
+  if(argptrw(0, (void*)&st, sizeof(*st)) < 0)
+    return -1;
+  if(p->trace_sig < 0)
+    return -1;
+
+  st->signum = p->trace_sig;
+  st->sent = p->sig_sent_tsc[p->trace_sig];
+  st->sendcpu = p->sig_sent_cpu[p->trace_sig];
+  st->picked = p->trace_picked;
+  st->delivered = p->trace_delivered;
+  st->delivercpu = p->trace_cpu;
+  return 0;
+}
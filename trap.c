@@ -32,6 +32,28 @@ idtinit(void)
   lidt(idt, sizeof(idt));
 }
 
+// Page fault at va. Returns 0 if the page was brought back from
+// swap, or filled in as part of an mmap() region, and the access
+// can be retried. The kernel may fault on a swapped-out user page
+// too, as long as it holds no spinlock and so can sleep.
+static int
+pgfault(struct trapframe *tf, uint va)
+{
+  struct proc *p = myproc();
+  int r;
+
+  if(p == 0 || va >= KERNBASE)
+    return -1;
+  if((tf->cs&3) == 0)
+    return mycpu()->ncli == 0 ? swapin(p, va) : -1;
+  p->insyscall = 1;
+  r = swapin(p, va);
+  if(r < 0)
+    r = mmapfault(p, va, tf->err & FEC_WR);
+  p->insyscall = 0;
+  return r;
+}
+
 //PAGEBREAK: 41
 void
 trap(struct trapframe *tf)
@@ -40,7 +62,10 @@ trap(struct trapframe *tf)
     if(myproc()->killed)
       exit();
     myproc()->tf = tf;
+    myproc()->insyscall = 1;
     syscall();
+    myproc()->insyscall = 0;
+    myproc()->nswappin = 0;
     if(myproc()->killed)
       exit();
     return;
@@ -78,6 +103,12 @@ trap(struct trapframe *tf)
     lapiceoi();
     break;
 
+  case T_PGFLT:
+    if(pgfault(tf, rcr2()) == 0)
+      break;
+    // Not a page that was swapped out or belongs to an mmap()
+    // region; treat like any other trap.
+
   //PAGEBREAK: 13
   default:
     if(myproc() == 0 || (tf->cs&3) == 0){
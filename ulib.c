@@ -36,7 +36,22 @@ strlen(char *s)
 void*
 memset(void *dst, int c, uint n)
 {
-  stosb(dst, c, n);
+  char *d;
+  uint k;
+
+  // A dword at a time where possible, as in the kernel's string.c.
+  d = dst;
+  c &= 0xFF;
+  if(n >= 16){
+    k = (4 - (uint)d%4) % 4;
+    stosb(d, c, k);
+    d += k;
+    n -= k;
+    stosl(d, (c<<24)|(c<<16)|(c<<8)|c, n/4);
+    d += n & ~3;
+    n %= 4;
+  }
+  stosb(d, c, n);
   return dst;
 }
 
@@ -96,10 +111,21 @@ void*
 memmove(void *vdst, void *vsrc, int n)
 {
   char *dst, *src;
+  int k;
 
+  // Copies forwards only, like it always has.
   dst = vdst;
   src = vsrc;
-  while(n-- > 0)
-    *dst++ = *src++;
+  if(n <= 0)
+    return vdst;
+  if(n >= 16 && (uint)src%4 == (uint)dst%4){
+    k = (4 - (uint)dst%4) % 4;
+    movsb(dst, src, k);
+    src += k, dst += k, n -= k;
+    movsl(dst, src, n/4);
+    src += n & ~3, dst += n & ~3;
+    n %= 4;
+  }
+  movsb(dst, src, n);
   return vdst;
 }
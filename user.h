@@ -2,6 +2,7 @@ typedef void (*sighandler_t)(int);
 
 struct stat;
 struct rtcdate;
+struct sigtrace;
 
 // system calls
 int fork(void);
@@ -28,6 +29,19 @@ int uptime(void);
 uint sigprocmask(uint);
 sighandler_t signal(int, sighandler_t);
 void sigret(void);
+int sigtrace(struct sigtrace*);
+int setpgid(int, int);
+int getpgid(int);
+char* sbrkhuge(int);
+void* mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
+int shm_open(char*, int);
+void* shm_attach(int);
+int shm_detach(void*);
+int futex_wait(int*, int);
+int futex_wake(int*);
+int fsync(int);
+int shm_close(int);
 
 // ulib.c
 int stat(char*, struct stat*);
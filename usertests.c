@@ -7,6 +7,7 @@
 #include "syscall.h"
 #include "traps.h"
 #include "memlayout.h"
+#include "mman.h"
 
 char buf[8192];
 char name[3];
@@ -264,6 +265,49 @@ createtest(void)
   printf(stdout, "many creates, followed by unlink; ok\n");
 }
 
+// fsync() with writes from several processes in flight.
+void
+fsynctest(void)
+{
+  int fd, i, pid;
+
+  printf(stdout, "fsync test\n");
+
+  if(fsync(-1) >= 0){
+    printf(stdout, "fsync of bad fd succeeded\n");
+    exit();
+  }
+  pid = fork();
+  fd = open(pid ? "fsync0" : "fsync1", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(stdout, "fsync: create failed\n");
+    exit();
+  }
+  for(i = 0; i < 20; i++){
+    memset(buf, 'a' + i, 512);
+    if(write(fd, buf, 512) != 512 || fsync(fd) < 0){
+      printf(stdout, "fsync: write or fsync failed\n");
+      exit();
+    }
+  }
+  close(fd);
+  if(pid == 0)
+    exit();
+  wait();
+
+  fd = open("fsync1", O_RDONLY);
+  for(i = 0; i < 20; i++){
+    if(read(fd, buf, 512) != 512 || buf[0] != 'a' + i || buf[511] != 'a' + i){
+      printf(stdout, "fsync: wrong data\n");
+      exit();
+    }
+  }
+  close(fd);
+  unlink("fsync0");
+  unlink("fsync1");
+  printf(stdout, "fsync ok\n");
+}
+
 void dirtest(void)
 {
   printf(stdout, "mkdir test\n");
@@ -400,6 +444,71 @@ preempt(void)
   printf(1, "preempt ok\n");
 }
 
+// setpgid(), getpgid(), and kill() of a whole process group.
+void
+pgkilltest(void)
+{
+  int i, pid, pids[3], other;
+
+  printf(1, "pgkill test\n");
+  for(i = 0; i < 3; i++){
+    pids[i] = fork();
+    if(pids[i] < 0){
+      printf(1, "pgkill: fork failed\n");
+      exit();
+    }
+    if(pids[i] == 0)
+      for(;;)
+        ;
+  }
+  other = fork();
+  if(other == 0)
+    for(;;)
+      ;
+
+  if(getpgid(pids[0]) != getpgid(0) || getpgid(other) != getpgid(0)){
+    printf(1, "pgkill: child not in parent's group\n");
+    exit();
+  }
+  if(setpgid(pids[0], 0) < 0 || setpgid(pids[1], pids[0]) < 0 ||
+     setpgid(pids[2], pids[0]) < 0){
+    printf(1, "pgkill: setpgid failed\n");
+    exit();
+  }
+  for(i = 0; i < 3; i++){
+    if(getpgid(pids[i]) != pids[0]){
+      printf(1, "pgkill: getpgid(%d) = %d, not %d\n", pids[i], getpgid(pids[i]), pids[0]);
+      exit();
+    }
+  }
+  if(getpgid(other) == pids[0] || setpgid(1, pids[0]) == 0){
+    printf(1, "pgkill: setpgid moved the wrong process\n");
+    exit();
+  }
+
+  if(kill(-pids[0], 9) < 0){
+    printf(1, "pgkill: kill of group failed\n");
+    exit();
+  }
+  for(i = 0; i < 3; i++){
+    pid = wait();
+    if(pid != pids[0] && pid != pids[1] && pid != pids[2]){
+      printf(1, "pgkill: wait got %d, not a group member\n", pid);
+      exit();
+    }
+  }
+  if(kill(-pids[0], 9) == 0){
+    printf(1, "pgkill: kill of empty group succeeded\n");
+    exit();
+  }
+  kill(other, 9);
+  if(wait() != other){
+    printf(1, "pgkill: process outside the group died\n");
+    exit();
+  }
+  printf(1, "pgkill test OK\n");
+}
+
 // try to find any races between exit and wait
 void
 exitwait(void)
@@ -1114,6 +1223,64 @@ subdir(void)
   printf(1, "subdir ok\n");
 }
 
+// sequential reads, which read ahead, by two processes at once
+// in pieces that straddle blocks, and then a re-read from the start.
+void
+readaheadtest(void)
+{
+  int fd, i, j, n, off, pid, pass;
+
+  printf(1, "readahead test\n");
+
+  unlink("readahead");
+  fd = open("readahead", O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf(1, "readahead: cannot create\n");
+    exit();
+  }
+  for(i = 0; i < 60; i++){
+    for(j = 0; j < 512; j++)
+      buf[j] = i + j;
+    if(write(fd, buf, 512) != 512){
+      printf(1, "readahead: write failed\n");
+      exit();
+    }
+  }
+  close(fd);
+
+  pid = fork();
+  if(pid < 0){
+    printf(1, "readahead: fork failed\n");
+    exit();
+  }
+  for(pass = 0; pass < 2; pass++){
+    fd = open("readahead", 0);
+    if(fd < 0){
+      printf(1, "readahead: cannot open\n");
+      exit();
+    }
+    off = 0;
+    while((n = read(fd, buf, 300)) > 0){
+      for(j = 0; j < n; j++, off++){
+        if(buf[j] != (char)(off/512 + off%512)){
+          printf(1, "readahead: wrong byte at %d\n", off);
+          exit();
+        }
+      }
+    }
+    close(fd);
+    if(n < 0 || off != 60*512){
+      printf(1, "readahead: read %d bytes, not %d\n", off, 60*512);
+      exit();
+    }
+  }
+  if(pid == 0)
+    exit();
+  wait();
+  unlink("readahead");
+  printf(1, "readahead test OK\n");
+}
+
 // test writes that are larger than the log.
 void
 bigwrite(void)
@@ -1411,6 +1578,240 @@ forktest(void)
   printf(1, "fork test OK\n");
 }
 
+// anonymous and file-backed mmap(), sharing across fork, munmap().
+void
+mmaptest(void)
+{
+  int fd, fd2, i, pid;
+  char *p, *q;
+
+  printf(stdout, "mmap test\n");
+
+  // private anonymous memory starts zeroed and is copied on fork
+  p = mmap(0, 3*4096, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+  if(p == MAP_FAILED){
+    printf(stdout, "mmap anon failed\n");
+    exit();
+  }
+  for(i = 0; i < 3*4096; i++)
+    if(p[i] != 0){
+      printf(stdout, "mmap anon not zero\n");
+      exit();
+    }
+  p[0] = 'a';
+  pid = fork();
+  if(pid == 0){
+    p[0] = 'b';
+    exit();
+  }
+  wait();
+  if(p[0] != 'a'){
+    printf(stdout, "mmap private shared with child\n");
+    exit();
+  }
+
+  // shared anonymous memory is seen by the parent
+  q = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
+  if(q == MAP_FAILED || q == p){
+    printf(stdout, "mmap shared anon failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid == 0){
+    q[100] = 'c';
+    exit();
+  }
+  wait();
+  if(q[100] != 'c'){
+    printf(stdout, "mmap shared not shared\n");
+    exit();
+  }
+  if(munmap(p, 3*4096) < 0 || munmap(q, 4096) < 0){
+    printf(stdout, "munmap failed\n");
+    exit();
+  }
+
+  // file mappings: read it, then write through a shared one
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  for(i = 0; i < sizeof(buf); i++)
+    buf[i] = i;
+  if(fd < 0 || write(fd, buf, sizeof(buf)) != sizeof(buf)){
+    printf(stdout, "mmap create file failed\n");
+    exit();
+  }
+  p = mmap(0, sizeof(buf), PROT_READ, MAP_PRIVATE, fd, 0);
+  if(p == MAP_FAILED){
+    printf(stdout, "mmap file failed\n");
+    exit();
+  }
+  for(i = 0; i < sizeof(buf); i++)
+    if(p[i] != (char)i){
+      printf(stdout, "mmap file wrong content\n");
+      exit();
+    }
+  // the kernel must not write into a read-only mapping
+  if(read(fd, p, 10) >= 0){
+    printf(stdout, "read into read-only mapping succeeded\n");
+    exit();
+  }
+  munmap(p, sizeof(buf));
+
+  q = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 4096);
+  if(q == MAP_FAILED){
+    printf(stdout, "mmap shared file failed\n");
+    exit();
+  }
+  q[0] = 'x';
+  // a second mapping of the page, read() and write() all see the
+  // same bytes
+  p = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 4096);
+  if(p == MAP_FAILED || p == q || p[0] != 'x'){
+    printf(stdout, "mmap shared file not shared\n");
+    exit();
+  }
+  p[1] = 'y';
+  fd2 = open("mmapfile", O_RDWR);
+  if(fd2 < 0 || read(fd2, buf, 4096) != 4096 || read(fd2, buf, 2) != 2 ||
+     buf[0] != 'x' || buf[1] != 'y' || write(fd2, "z", 1) != 1 || q[2] != 'z'){
+    printf(stdout, "mmap shared file not coherent\n");
+    exit();
+  }
+  close(fd2);
+  munmap(p, 4096);
+  munmap(q, 4096);
+  close(fd);
+
+  fd = open("mmapfile", O_RDONLY);
+  if(fd < 0 || read(fd, buf, sizeof(buf)) != sizeof(buf) ||
+     buf[4096] != 'x' || buf[4097] != 'y' || buf[4098] != 'z' ||
+     buf[4099] != (char)4099){
+    printf(stdout, "mmap shared file not written back\n");
+    exit();
+  }
+  close(fd);
+  unlink("mmapfile");
+
+  printf(stdout, "mmap test OK\n");
+}
+
+// fill memory and the swap area until sbrk() fails, then hand the
+// kernel buffers of swapped-out pages: write() and read() must bring
+// them all in, and keep them in while they copy.
+void
+swaptest(void)
+{
+  char *base, *p;
+  int fd, i, n, pid;
+
+  printf(stdout, "swap test\n");
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    base = sbrk(0);
+    for(n = 0; sbrk(4096) != (char*)-1; n++)
+      *(int*)(base + n*4096) = n;
+    if(n < 64){
+      printf(stdout, "swap test: only %d pages\n", n);
+      exit();
+    }
+    // a little room, so that bringing pages in must push others out
+    sbrk(-8*4096);
+    n -= 8;
+
+    // the lowest pages went out first
+    fd = open("swapfile", O_CREATE|O_RDWR);
+    if(fd < 0 || write(fd, base, 16*4096) != 16*4096){
+      printf(stdout, "swap write failed\n");
+      exit();
+    }
+    close(fd);
+    p = base + 32*4096;
+    fd = open("swapfile", O_RDONLY);
+    if(fd < 0 || read(fd, p, 16*4096) != 16*4096){
+      printf(stdout, "swap read failed\n");
+      exit();
+    }
+    close(fd);
+    unlink("swapfile");
+    for(i = 0; i < 16; i++)
+      if(*(int*)(p + i*4096) != i){
+        printf(stdout, "swap read wrong data\n");
+        exit();
+      }
+    for(i = 0; i < n; i += 97)
+      if(*(int*)(base + i*4096) != i){
+        printf(stdout, "swap lost page %d\n", i);
+        exit();
+      }
+    exit();
+  }
+  wait();
+  printf(stdout, "swap test OK\n");
+}
+
+// a segment attached separately by two processes, with a futex handoff.
+void
+shmtest(void)
+{
+  int id, i, pid;
+  int *flag;
+  char *p;
+
+  printf(stdout, "shm test\n");
+  if((id = shm_open("shmtest", 2*4096)) < 0 || (p = shm_attach(id)) == (char*)-1){
+    printf(stdout, "shm_open/shm_attach failed\n");
+    exit();
+  }
+  flag = (int*)p;
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    // attach again, at a different address, and fill it in
+    p = shm_attach(shm_open("shmtest", 0));
+    if(p == (char*)-1 || (int*)p == flag){
+      printf(stdout, "shm second attach failed\n");
+      exit();
+    }
+    for(i = 4; i < 2*4096; i++)
+      p[i] = i;
+    *(int*)p = 1;
+    futex_wake((int*)p);
+    exit();
+  }
+  while(*flag == 0)
+    futex_wait(flag, 0);
+  for(i = 4; i < 2*4096; i++)
+    if(p[i] != (char)i){
+      printf(stdout, "shm data wrong\n");
+      exit();
+    }
+  wait();
+  if(shm_detach(p) < 0 || shm_close(id) < 0){
+    printf(stdout, "shm_detach/shm_close failed\n");
+    exit();
+  }
+
+  // a segment goes with its last close even if never attached,
+  // and its id does not name the next segment in its slot
+  if((id = shm_open("shmgone", 4096)) < 0 || shm_close(id) < 0 ||
+     shm_close(id) >= 0 || shm_attach(id) != (char*)-1){
+    printf(stdout, "shm unattached segment not freed\n");
+    exit();
+  }
+  if((i = shm_open("shmnext", 4096)) < 0 || i == id ||
+     shm_attach(id) != (char*)-1 || shm_close(i) < 0){
+    printf(stdout, "shm stale id accepted\n");
+    exit();
+  }
+  printf(stdout, "shm test OK\n");
+}
+
 void
 sbrktest(void)
 {
@@ -1765,15 +2166,20 @@ main(int argc, char *argv[])
 
   bigargtest();
   bigwrite();
+  readaheadtest();
   bigargtest();
   bsstest();
   sbrktest();
+  swaptest();
+  mmaptest();
+  shmtest();
   validatetest();
 
   opentest();
   writetest();
   writetest1();
   createtest();
+  fsynctest();
 
   openiputtest();
   exitiputtest();
@@ -1782,6 +2188,7 @@ main(int argc, char *argv[])
   mem();
   pipe1();
   preempt();
+  pgkilltest();
   exitwait();
 
   rmdot();
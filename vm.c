@@ -9,6 +9,9 @@
 
 extern char data[];  // defined by kernel.ld
 pde_t *kpgdir;  // for use in scheduler()
+uint phystop = PHYSTOP;   // top of physical memory; set by kvmalloc()
+
+#define HUGEORDER (PDXSHIFT - PGSHIFT)  // kalloc_order() order of a large page
 
 // Set up CPU's kernel segment descriptors.
 // Run once on entry on each CPU.
@@ -31,21 +34,23 @@ seginit(void)
 
 // Return the address of the PTE in page table pgdir
 // that corresponds to virtual address va.  If alloc!=0,
-// create any required page table pages.
-static pte_t *
+// create any required page table pages. Use a pgwalk
+// (below) to visit a range of pages.
+pte_t *
 walkpgdir(pde_t *pgdir, const void *va, int alloc)
 {
   pde_t *pde;
   pte_t *pgtab;
 
   pde = &pgdir[PDX(va)];
+  if(*pde & PTE_PS)
+    panic("walkpgdir: large page");
   if(*pde & PTE_P){
     pgtab = (pte_t*)P2V(PTE_ADDR(*pde));
   } else {
-    if(!alloc || (pgtab = (pte_t*)kalloc()) == 0)
-      return 0;
     // Make sure all those PTE_P bits are zero.
-    memset(pgtab, 0, PGSIZE);
+    if(!alloc || (pgtab = (pte_t*)kalloc_zeroed()) == 0)
+      return 0;
     // The permissions here are overly generous, but they can
     // be further restricted by the permissions in the page table
     // entries, if necessary.
@@ -54,29 +59,107 @@ walkpgdir(pde_t *pgdir, const void *va, int alloc)
   return &pgtab[PTX(va)];
 }
 
+// Walks the PTEs of n consecutive pages from va, visiting them in
+// place within each page-table page; the directory is consulted
+// only once per page table. Without alloc, pages whose page table
+// is missing are skipped a whole table at a time. A large page
+// is visited once, as its PDE, with w->large set.
+struct pgwalk {
+  pde_t *pgdir;
+  uint va;        // address of the next page
+  uint n;         // pages left
+  int alloc;      // create missing page tables
+  int large;      // last entry returned was a PTE_PS PDE
+  pte_t *pte;     // PTE of va, or 0 to look it up
+};
+
+static void
+pgwalkinit(struct pgwalk *w, pde_t *pgdir, uint va, uint n, int alloc)
+{
+  w->pgdir = pgdir;
+  w->va = va;
+  w->n = n;
+  w->alloc = alloc;
+  w->large = 0;
+  w->pte = 0;
+}
+
+// Return the next entry and set *va to its address, or return 0
+// when done. Also returns 0, with w->n > 0, if a page table could
+// not be allocated.
+static pte_t*
+pgwalknext(struct pgwalk *w, uint *va)
+{
+  pde_t *pde;
+  pte_t *pte, *pgtab;
+  uint k;
+
+  while(w->n > 0){
+    if(w->pte == 0){
+      pde = &w->pgdir[PDX(w->va)];
+      k = NPTENTRIES - PTX(w->va);  // pages left in this table
+      if(k > w->n)
+        k = w->n;
+      if(*pde & PTE_PS){
+        *va = w->va;
+        w->va += k*PGSIZE;
+        w->n -= k;
+        w->large = 1;
+        return pde;
+      }
+      if((*pde & PTE_P) == 0){
+        if(!w->alloc){
+          w->va += k*PGSIZE;
+          w->n -= k;
+          continue;
+        }
+        // Make sure all those PTE_P bits are zero.
+        if((pgtab = (pte_t*)kalloc_zeroed()) == 0)
+          return 0;
+        *pde = V2P(pgtab) | PTE_P | PTE_W | PTE_U;
+      }
+      w->pte = (pte_t*)P2V(PTE_ADDR(*pde)) + PTX(w->va);
+    }
+    *va = w->va;
+    pte = w->pte;
+    w->va += PGSIZE;
+    w->n--;
+    w->large = 0;
+    w->pte = PTX(w->va) == 0 ? 0 : pte + 1;
+    return pte;
+  }
+  return 0;
+}
+
+// Move w forward to va.
+static void
+pgwalkseek(struct pgwalk *w, uint va)
+{
+  w->n -= (va - w->va) / PGSIZE;
+  w->va = va;
+  w->pte = 0;
+}
+
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
 // be page-aligned.
-static int
+int
 mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 {
-  char *a, *last;
+  struct pgwalk w;
+  uint a, last;
   pte_t *pte;
 
-  a = (char*)PGROUNDDOWN((uint)va);
-  last = (char*)PGROUNDDOWN(((uint)va) + size - 1);
-  for(;;){
-    if((pte = walkpgdir(pgdir, a, 1)) == 0)
-      return -1;
-    if(*pte & PTE_P)
+  a = PGROUNDDOWN((uint)va);
+  last = PGROUNDDOWN(((uint)va) + size - 1);
+  pgwalkinit(&w, pgdir, a, (last - a)/PGSIZE + 1, 1);
+  while((pte = pgwalknext(&w, &a)) != 0){
+    if(w.large || (*pte & PTE_P))
       panic("remap");
     *pte = pa | perm | PTE_P;
-    if(a == last)
-      break;
-    a += PGSIZE;
     pa += PGSIZE;
   }
-  return 0;
+  return w.n > 0 ? -1 : 0;
 }
 
 // There is one page table per process, plus one that's used when
@@ -92,13 +175,21 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 //   KERNBASE..KERNBASE+EXTMEM: mapped to 0..EXTMEM (for I/O space)
 //   KERNBASE+EXTMEM..data: mapped to EXTMEM..V2P(data)
 //                for the kernel's instructions and r/o data
-//   data..KERNBASE+PHYSTOP: mapped to V2P(data)..PHYSTOP,
+//   data..KERNBASE+phystop: mapped to V2P(data)..phystop,
 //                                  rw data + free physical memory
 //   0xfe000000..0: mapped direct (devices such as ioapic)
 //
+// Every 4 MB aligned stretch of those is mapped with one large
+// (PTE_PS) page directory entry; only the first 4 MB, which holds
+// the read-only kernel text, uses 4 KB pages.
+//
 // The kernel allocates physical memory for its heap and for user memory
-// between V2P(end) and the end of physical memory (PHYSTOP)
-// (directly addressable from end..P2V(PHYSTOP)).
+// between V2P(end) and the end of physical memory (phystop)
+// (directly addressable from end..P2V(phystop)). kvmalloc() sets
+// phystop from the memory size the BIOS recorded in the CMOS,
+// capped at PHYSMAX, or to PHYSTOP if the CMOS has none. Until
+// then it is PHYSTOP, so that kfree() accepts the pages kinit1()
+// frees below 4 MB.
 
 // This table defines the kernel's mappings, which are present in
 // every process's page table.
@@ -110,37 +201,90 @@ static struct kmap {
 } kmap[] = {
  { (void*)KERNBASE, 0,             EXTMEM,    PTE_W}, // I/O space
  { (void*)KERNLINK, V2P(KERNLINK), V2P(data), 0},     // kern text+rodata
- { (void*)data,     V2P(data),     PHYSTOP,   PTE_W}, // kern data+memory
+ { (void*)data,     V2P(data),     0,         PTE_W}, // kern data+memory
  { (void*)DEVSPACE, DEVSPACE,      0,         PTE_W}, // more devices
 };
 
-// Set up kernel part of a page table.
+// Map kmap[] entry k into pgdir, using a 4 MB page wherever
+// both addresses are 4 MB aligned and 4 MB remain.
+static int
+mapkernel(pde_t *pgdir, struct kmap *k)
+{
+  char *va;
+  uint pa, size, n;
+
+  va = k->virt;
+  pa = k->phys_start;
+  size = k->phys_end - k->phys_start;
+  while(size > 0){
+    if((uint)va % HUGEPGSIZE == 0 && pa % HUGEPGSIZE == 0 &&
+       size >= HUGEPGSIZE){
+      if(pgdir[PDX(va)] & PTE_P)
+        panic("remap");
+      pgdir[PDX(va)] = pa | k->perm | PTE_P | PTE_PS;
+      n = HUGEPGSIZE;
+    } else {
+      n = PGSIZE;
+      if(mappages(pgdir, va, n, pa, k->perm) < 0)
+        return -1;
+    }
+    va += n;
+    pa += n;
+    size -= n;
+  }
+  return 0;
+}
+
+// Set up kernel part of a page table. The kernel half of
+// every page directory points at the page-table pages that
+// kvmalloc() built once for kpgdir, so only the top-level
+// PDEs are copied; freevm() leaves them alone. Directories
+// that freevm() kept on this cpu are already in that state
+// and are handed out first.
 pde_t*
 setupkvm(void)
 {
   pde_t *pgdir;
-  struct kmap *k;
+  struct cpu *c;
+
+  pushcli();
+  c = mycpu();
+  pgdir = c->npgdir > 0 ? c->pgdirs[--c->npgdir] : 0;
+  popcli();
+  if(pgdir)
+    return pgdir;
 
-  if((pgdir = (pde_t*)kalloc()) == 0)
+  if((pgdir = (pde_t*)kalloc_zeroed()) == 0)
     return 0;
-  memset(pgdir, 0, PGSIZE);
-  if (P2V(PHYSTOP) > (void*)DEVSPACE)
-    panic("PHYSTOP too high");
-  for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
-    if(mappages(pgdir, k->virt, k->phys_end - k->phys_start,
-                (uint)k->phys_start, k->perm) < 0) {
-      freevm(pgdir);
-      return 0;
-    }
+  memmove(&pgdir[PDX(KERNBASE)], &kpgdir[PDX(KERNBASE)],
+          (NPDENTRIES - PDX(KERNBASE)) * sizeof(pde_t));
   return pgdir;
 }
 
 // Allocate one page table for the machine for the kernel address
-// space for scheduler processes.
+// space for scheduler processes. Its kernel page-table pages are
+// shared by every process page table, so the kernel mappings must
+// not change after this.
 void
 kvmalloc(void)
 {
-  kpgdir = setupkvm();
+  struct kmap *k;
+  uint kb;
+
+  kb = cmosmemsize();
+  if(kb == 0)
+    phystop = PHYSTOP;
+  else if(kb > PHYSMAX/1024)
+    phystop = PHYSMAX;
+  else
+    phystop = PGROUNDDOWN(kb*1024);
+  kmap[2].phys_end = phystop;
+
+  if((kpgdir = (pde_t*)kalloc_zeroed()) == 0)
+    panic("kvmalloc");
+  for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
+    if(mapkernel(kpgdir, k) < 0)
+      panic("kvmalloc: mapkernel");
   switchkvm();
 }
 
@@ -186,8 +330,7 @@ inituvm(pde_t *pgdir, char *init, uint sz)
 
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pgdir, 0, PGSIZE, V2P(mem), PTE_W|PTE_U);
   memmove(mem, init, sz);
 }
@@ -197,13 +340,15 @@ inituvm(pde_t *pgdir, char *init, uint sz)
 int
 loaduvm(pde_t *pgdir, char *addr, struct inode *ip, uint offset, uint sz)
 {
-  uint i, pa, n;
+  struct pgwalk w;
+  uint i, pa, n, va;
   pte_t *pte;
 
   if((uint) addr % PGSIZE != 0)
     panic("loaduvm: addr must be page aligned");
+  pgwalkinit(&w, pgdir, (uint)addr, PGROUNDUP(sz)/PGSIZE, 0);
   for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, addr+i, 0)) == 0)
+    if((pte = pgwalknext(&w, &va)) == 0 || w.large || va != (uint)addr+i)
       panic("loaduvm: address should exist");
     pa = PTE_ADDR(*pte);
     if(sz - i < PGSIZE)
@@ -221,7 +366,9 @@ loaduvm(pde_t *pgdir, char *addr, struct inode *ip, uint offset, uint sz)
 int
 allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 {
+  struct pgwalk w;
   char *mem;
+  pte_t *pte;
   uint a;
 
   if(newsz >= KERNBASE)
@@ -230,20 +377,54 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
     return oldsz;
 
   a = PGROUNDUP(oldsz);
-  for(; a < newsz; a += PGSIZE){
-    mem = kalloc();
+  if(a >= newsz)
+    return newsz;
+  pgwalkinit(&w, pgdir, a, (PGROUNDUP(newsz) - a)/PGSIZE, 1);
+  while((pte = pgwalknext(&w, &a)) != 0){
+    if(w.large){
+      // Still mapped by a large page that deallocuvm() kept.
+      memset(P2V(PTE_ADDR(*pte)) + a % HUGEPGSIZE, 0, w.va - a);
+      continue;
+    }
+    if(*pte & PTE_P)
+      panic("remap");
+    mem = swapalloc(1);
     if(mem == 0){
       cprintf("allocuvm out of memory\n");
       deallocuvm(pgdir, newsz, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
-    if(mappages(pgdir, (char*)a, PGSIZE, V2P(mem), PTE_W|PTE_U) < 0){
-      cprintf("allocuvm out of memory (2)\n");
-      deallocuvm(pgdir, newsz, oldsz);
-      kfree(mem);
+    *pte = V2P(mem) | PTE_W | PTE_U | PTE_P;
+  }
+  if(w.n > 0){
+    cprintf("allocuvm out of memory (2)\n");
+    deallocuvm(pgdir, newsz, oldsz);
+    return 0;
+  }
+  return newsz;
+}
+
+// Map large pages from oldsz, which must be 4 MB aligned, to newsz
+// rounded up to 4 MB. Returns the new size or 0 on error.
+int
+allochugeuvm(pde_t *pgdir, uint oldsz, uint newsz)
+{
+  char *mem;
+  uint a;
+
+  if(oldsz % HUGEPGSIZE)
+    panic("allochugeuvm");
+  newsz = HUGEPGROUNDUP(newsz);
+  if(newsz >= KERNBASE || newsz < oldsz)
+    return 0;
+
+  for(a = oldsz; a < newsz; a += HUGEPGSIZE){
+    if((mem = kalloc_order(HUGEORDER)) == 0){
+      deallocuvm(pgdir, a, oldsz);
       return 0;
     }
+    memset(mem, 0, HUGEPGSIZE);
+    pgdir[PDX(a)] = V2P(mem) | PTE_PS | PTE_P | PTE_W | PTE_U;
   }
   return newsz;
 }
@@ -252,9 +433,11 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
 // process size.  Returns the new process size.
+// A large page is freed only once all of it lies above newsz.
 int
 deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 {
+  struct pgwalk w;
   pte_t *pte;
   uint a, pa;
 
@@ -262,39 +445,91 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
     return oldsz;
 
   a = PGROUNDUP(newsz);
-  for(; a  < oldsz; a += PGSIZE){
-    pte = walkpgdir(pgdir, (char*)a, 0);
-    if(!pte)
-      a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
-    else if((*pte & PTE_P) != 0){
+  if(a >= oldsz)
+    return newsz;
+  pgwalkinit(&w, pgdir, a, (PGROUNDUP(oldsz) - a)/PGSIZE, 0);
+  while((pte = pgwalknext(&w, &a)) != 0){
+    if(w.large){
+      if(a % HUGEPGSIZE == 0){
+        kfree_order(P2V(PTE_ADDR(*pte)), HUGEORDER);
+        *pte = 0;
+      }
+      continue;
+    }
+    if((*pte & PTE_P) != 0){
       pa = PTE_ADDR(*pte);
       if(pa == 0)
         panic("kfree");
       char *v = P2V(pa);
       kfree(v);
       *pte = 0;
+    } else if(*pte & PTE_SWAPPED){
+      swapdrop(*pte);
+      *pte = 0;
     }
   }
   return newsz;
 }
 
+// Clock sweep for swapout() (swap.c): walk the user pages of
+// pgdir from *va up to sz, clearing PTE_A where it is set, and
+// stop at the first page without it. Returns that page's PTE
+// with *va set to its address, or 0 at sz. *refs counts the
+// PTE_A bits cleared; if pgdir is in use the caller must flush
+// them from the TLB.
+pte_t*
+uvmclock(pde_t *pgdir, uint *va, uint sz, int *refs)
+{
+  struct pgwalk w;
+  pte_t *pte;
+
+  *refs = 0;
+  if(*va >= sz)
+    return 0;
+  pgwalkinit(&w, pgdir, *va, (PGROUNDUP(sz) - *va)/PGSIZE, 0);
+  while((pte = pgwalknext(&w, va)) != 0){
+    if(w.large || (*pte & (PTE_P|PTE_U)) != (PTE_P|PTE_U))
+      continue;
+    if(*pte & PTE_A){
+      *pte &= ~PTE_A;
+      (*refs)++;
+      continue;
+    }
+    return pte;
+  }
+  return 0;
+}
+
 // Free a page table and all the physical memory pages
-// in the user part.
+// in the user part. The kernel page-table pages are shared
+// (see setupkvm()) and stay. What is left is a kernel-only
+// directory, which this cpu keeps for setupkvm() if it has room.
 void
 freevm(pde_t *pgdir)
 {
   uint i;
+  struct cpu *c;
 
   if(pgdir == 0)
     panic("freevm: no pgdir");
   deallocuvm(pgdir, KERNBASE, 0);
-  for(i = 0; i < NPDENTRIES; i++){
-    if(pgdir[i] & PTE_P){
+  for(i = 0; i < PDX(KERNBASE); i++){
+    if((pgdir[i] & (PTE_P|PTE_PS)) == PTE_P){
       char * v = P2V(PTE_ADDR(pgdir[i]));
       kfree(v);
     }
+    pgdir[i] = 0;
   }
-  kfree((char*)pgdir);
+
+  pushcli();
+  c = mycpu();
+  if(c->npgdir < NSKEL){
+    c->pgdirs[c->npgdir++] = pgdir;
+    pgdir = 0;
+  }
+  popcli();
+  if(pgdir)
+    kfree((char*)pgdir);
 }
 
 // Clear PTE_U on a page. Used to create an inaccessible
@@ -315,26 +550,49 @@ clearpteu(pde_t *pgdir, char *uva)
 pde_t*
 copyuvm(pde_t *pgdir, uint sz)
 {
+  struct pgwalk w, dw;
   pde_t *d;
-  pte_t *pte;
-  uint pa, i, flags;
+  pte_t *pte, *dpte;
+  uint pa, i, di, next, flags;
   char *mem;
 
   if((d = setupkvm()) == 0)
     return 0;
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
+  pgwalkinit(&w, pgdir, 0, PGROUNDUP(sz)/PGSIZE, 0);
+  pgwalkinit(&dw, d, 0, PGROUNDUP(sz)/PGSIZE, 1);
+  next = 0;
+  while((pte = pgwalknext(&w, &i)) != 0){
+    if(i != next)
       panic("copyuvm: pte should exist");
-    if(!(*pte & PTE_P))
-      panic("copyuvm: page not present");
-    pa = PTE_ADDR(*pte);
-    flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    next = w.va;
+    if(w.large){
+      if((mem = kalloc_order(HUGEORDER)) == 0)
+        goto bad;
+      memmove(mem, P2V(PTE_ADDR(*pte)), HUGEPGSIZE);
+      d[PDX(i)] = V2P(mem) | PTE_FLAGS(*pte);
+      pgwalkseek(&dw, w.va);
+      continue;
+    }
+    if((mem = swapalloc(0)) == 0)
       goto bad;
-    memmove(mem, (char*)P2V(pa), PGSIZE);
-    if(mappages(d, (void*)i, PGSIZE, V2P(mem), flags) < 0)
+    // Look at the PTE only now: swapalloc() may have swapped it out.
+    if(*pte & PTE_SWAPPED){
+      swapcopy(*pte, mem);
+      flags = (PTE_FLAGS(*pte) & ~PTE_SWAPPED) | PTE_P;
+    } else if(*pte & PTE_P){
+      pa = PTE_ADDR(*pte);
+      flags = PTE_FLAGS(*pte);
+      memmove(mem, (char*)P2V(pa), PGSIZE);
+    } else
+      panic("copyuvm: page not present");
+    if((dpte = pgwalknext(&dw, &di)) == 0){
+      kfree(mem);
       goto bad;
+    }
+    *dpte = V2P(mem) | flags;
   }
+  if(next != PGROUNDUP(sz))
+    panic("copyuvm: pte should exist");
   return d;
 
 bad:
@@ -348,9 +606,16 @@ char*
 uva2ka(pde_t *pgdir, char *uva)
 {
   pte_t *pte;
+  pde_t pde;
 
+  pde = pgdir[PDX(uva)];
+  if(pde & PTE_PS){
+    if((pde & (PTE_P|PTE_U)) != (PTE_P|PTE_U))
+      return 0;
+    return (char*)P2V(PTE_ADDR(pde)) + PGROUNDDOWN((uint)uva % HUGEPGSIZE);
+  }
   pte = walkpgdir(pgdir, uva, 0);
-  if((*pte & PTE_P) == 0)
+  if(pte == 0 || (*pte & PTE_P) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;